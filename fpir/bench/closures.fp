@@ -0,0 +1,9 @@
+(:self :f :n (f $n 1 sub $f self) (0 drop) $n 0 eq if) rec :times
+(0 :n ($n 1 add ^n $n)) :mkcounter
+mkcounter :c
+mkcounter :d
+clock :start
+100000 (c drop d d add drop) times
+c print
+d print
+clock $start sub print
@@ -0,0 +1,13 @@
+(:self :f :n (f $n 1 sub $f self) (0 drop) $n 0 eq if) rec :times
+(:a :b :c
+ $a $b add ^c
+ $c $a sub ^a
+ $b $c add :d
+ $d $a add ^b
+ $a $b $c $d add add add :e
+ $e 1 add ^e
+ $e) :mix
+clock :start
+100000 (1 2 3 mix drop) times
+1 2 3 mix print
+clock $start sub print
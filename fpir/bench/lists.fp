@@ -0,0 +1,8 @@
+(:self :f :n (f $n 1 sub $f self) (0 drop) $n 0 eq if) rec :times
+(:self :acc :n $n 1 sub $acc $n cons (self) (drop drop $acc) $n 0 eq if) rec :build
+(:self :l :s ($s) ($s $l car add $l cdr self) $l tag 0 eq if) rec :sum
+clock :start
+50 (0 5000 0 build sum drop) times
+20000 0 build :big
+0 $big sum print
+clock $start sub print
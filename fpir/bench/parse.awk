@@ -0,0 +1,18 @@
+# Generates a large input for the parse benchmark: lots of top level
+# definitions of nested bodies, drawing on a small pool of symbols.
+BEGIN {
+  srand(1)
+  print "clock :start"
+  for (i = 0; i < 4000; ++i) {
+    line = "("
+    for (j = 0; j < 12; ++j) {
+      r = int(rand() * 4)
+      if (r == 0) line = line " w" int(rand() * 200)
+      else if (r == 1) line = line " " int(rand() * 100000)
+      else if (r == 2) line = line " (w" int(rand() * 200) " " j ")"
+      else line = line " $w" int(rand() * 200)
+    }
+    print line " ) :p"
+  }
+  print "clock $start sub print"
+}
@@ -0,0 +1,6 @@
+(:self :f :n (f $n 1 sub $f self) (0 drop) $n 0 eq if) rec :times
+(:self :n ($n 1 sub self $n add) (0) $n 0 eq if) rec :tri
+clock :start
+100 (2000 tri drop) times
+2000 tri print
+clock $start sub print
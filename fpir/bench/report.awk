@@ -0,0 +1,9 @@
+# Summarises the --stats report of one benchmark run as a table row.
+$1 == "ops" {ops = $2}
+$1 == "run-ns" {ns = $2}
+$1 == "minor-gcs" || $1 == "full-gcs" {gcs += $2}
+$1 == "pause-ns" {pause = $2}
+END {
+  printf "%-12s %10.1f %12d %14d %8d %10.1f\n",
+    name, ns / 1e6, ops, ops / (ns / 1e9), gcs, pause / 1e6
+}
@@ -1,9 +1,3 @@
-(:x x) :force
-(cswap drop force) :if
-(:f (:x ($x x) f) (:x ($x x) f) force) :fix
-(:g ($g fix)) :rec
-(:self :n $n 1 sub (self) (drop 'done print) $n print $n 0 eq if) rec :count
-
 (
   268435456 :ubase
   0 $ubase 1 add store_b
@@ -0,0 +1,15 @@
+(:self :f :n (f $n 1 sub $f self) (0 drop) $n 0 eq if) rec :times
+(:self :n ($n 1 sub self $n add) (0) $n 0 eq if) rec :tri
+(:self :acc :n $n 1 sub $acc $n cons (self) (drop drop $acc) $n 0 eq if) rec :build
+(:self :l :s ($s) ($s $l car add $l cdr self) $l tag 0 eq if) rec :sum
+(0 :n ($n 1 add ^n $n)) :mkcounter
+(:a :b :c $a $b add ^c $b $c add :d $d $a add ^b $a $b $c $d add add add) :mix
+mkcounter :c
+20 (c drop) times
+c print
+50 tri print
+0 (100 0 build) force sum print
+1 2 3 mix print
+'sym print
+(1 (2 'x) $c) print
+5 count
@@ -0,0 +1,5 @@
+(:self :n ($n 1 sub self $n add) (0) $n 0 eq if) rec :tri
+(:self :acc :n $n 1 sub $acc $n cons (self) (drop drop $acc) $n 0 eq if) rec :build
+(:self :l :s ($s) ($s $l car add $l cdr self) $l tag 0 eq if) rec :sum
+1000 tri print
+0 (5000 0 build) force sum print
@@ -1,12 +1,11 @@
 /********************************************************************/
 /*                 On reading and editing this file                 */
 /*                                                                  */
-/* The C in this file is extremely delicate. This file should be    */
-/* compiled without optimizations, and seemingly quick fixes on the */
-/* programmer's part should be considered *very* carefully. This is */
-/* entirely because of new_cons. This is because new_cons returns   */
-/* pointers to interally garbage collected regions of memory, the   */
-/* lifetime of which follows the follwing rules:                    */
+/* The C in this file is extremely delicate. Seemingly quick fixes  */
+/* on the programmer's part should be considered *very* carefully.  */
+/* This is entirely because of new_cons. This is because new_cons   */
+/* returns pointers to interally garbage collected regions of       */
+/* memory, the lifetime of which follows the follwing rules:        */
 /*                                                                  */
 /* A pointer to a cons cell (16 bytes) returned by new_cons is      */
 /* valid until the next time garbage collection happens. If the     */
@@ -22,14 +21,19 @@
 /*                                                                  */
 /* ONLY ONE VALUE RETURNED BY new_cons SHOULD BE FLOATING AT A TIME */
 /*                                                                  */
-/* Best practice is to place the floating value on the state        */
-/* machine stack before calling new_cons again, as all valid stack  */
-/* slots are roots. To facilitate the construction of linked data   */
-/* between abstract state machine states, NULL (0) is a valid child */
-/* pointer from cons cells, and will be ignored by the garbage      */
-/* collector. Note that it is *not* a valid pointer for a cons      */
-/* cell as it would be used by the abstract state machine. NIL has  */
-/* its own representation.                                          */
+/* unless the others are roots. Either place the floating value on  */
+/* the state machine stack before calling new_cons again, as all    */
+/* valid stack slots are roots, or register the C local holding it  */
+/* with ROOT_WORD/ROOT_CELL between ROOTS_BEGIN and ROOTS_END, and  */
+/* the collector will keep it up to date. Done that way, the file   */
+/* is safe to compile with optimizations, and --gc-stress (a        */
+/* collection on every allocation) is the way to check that it has  */
+/* been. To facilitate the construction of linked data between      */
+/* abstract state machine states, NULL (0) is a valid child pointer */
+/* from cons cells, and will be ignored by the garbage collector.   */
+/* Note that it is *not* a valid pointer for a cons cell as it      */
+/* would be used by the abstract state machine. NIL has its own     */
+/* representation.                                                  */
 /*                                                                  */
 /* More details about the thought process behind this decision can  */
 /* be found here: [gc.org]                                          */
@@ -40,7 +44,9 @@
 
 // #include <sys/cdefs.h>
 
+#ifndef NO_SANITY_CHECKS
 #define SANITY_CHECKS_ENABLED
+#endif
 // #define BAREMETAL
 
 #ifdef SANITY_CHECKS_ENABLED
@@ -57,24 +63,46 @@
 #define ASSERT(condition, msg)                  \
   if (!(condition)) panic(msg)
 
+/* Everything an interpreter changes as it runs belongs to the thread
+   running it, so that the batch runner (see run_batch) can run a
+   separate interpreter, with its own heap, on each of several
+   threads. Settings picked at startup are shared. A thread runs one
+   job after another, and reset_interp starts each one off clean. */
+#ifdef BAREMETAL
+#define PER_INTERP
+#else
+#define PER_INTERP __thread
+#endif
+
 #ifdef BAREMETAL
 #include "riscv.h"
 #endif
 
 #ifndef BAREMETAL
 #include <stdio.h>
-void putstring(char* s) {fputs(s, stdout);}
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <setjmp.h>
+#include <pthread.h>
+char* getenv(const char*);
+void exit(int);
+void* realloc(void*, unsigned long);
+void free(void*);
+/* ^ stdlib.h has its own idea of what a ulong is */
+int close(int);
+/* ^ and unistd.h of what read is */
 #else
 extern char getchar(void);
 extern void putchar(char);
-extern void putstring(char*);
 #endif
 
 #ifndef BAREMETAL
-#ifdef SANITY_CHECKS_ENABLED
 #include <string.h>
 #endif
-#endif
 
 typedef unsigned long long ulong;
 _Static_assert (sizeof(ulong) == 8, "ulong isn't a 8byte word");
@@ -88,43 +116,90 @@ _Static_assert (sizeof(ulong*) == 8, "ulong* isn't a 8byte word");
 
 #define MAX_PRINT_DEPTH 8
 
-#define MEMSIZE 0x200000
-// ^ Approx 2MB
-#ifdef SANITY_CHECKS_ENABLED
-const ulong MIDPOINT = (MEMSIZE/2);
-const ulong DSTART = 0;
-const ulong SSTART = (MIDPOINT - 16);
-const ulong HSTART = (MIDPOINT);
-const ulong HEAPSIZE = (MEMSIZE/2);
-const ulong SEMIHEAPSIZE = (HEAPSIZE/2);
-const ulong STACKSIZE = (MEMSIZE/2);
+/* The symbol table and the global environment have an entry for every
+   SYM_BYTES bytes of dictionary, rounded up to a power of two, so a
+   bigger --dict makes room for more symbols as well as longer ones. */
+#define SYM_BYTES 16
+#define MIN_SYMTAB_ENTRIES 0x2000
+#define MAX_SYMTAB_ENTRIES (1ULL << 24)
+// ^ a global binding's index has to fit in an op, see OP_GSLOT
+
+/* Sizes of the regions of memory, in bytes. These are the defaults,
+   and on linux they can be changed at startup (see configure). M holds
+   the symbol table, the global environment, the remembered set, the
+   dictionary, the stack and the frames of the return stack, in that
+   order. The heap is the nursery followed by the two semispaces, which
+   on linux are each mapped on their own so that they can grow. */
+ulong HEAPSIZE = 0x100000;
+ulong DICTSIZE = 0x40000;
+ulong STACKSIZE = 0x80000;
+ulong FRAMESIZE = 0x100000;
+ulong HEAPMAX = 0x40000000;
+// ^ the semispaces stop growing once the whole heap would pass this
+#define GROW_PERCENT 50
+// ^ grow when more than this much of a semispace survives a collection
+
+PER_INTERP ulong NURSERYSIZE, SEMIHEAPSIZE, REMSET_ENTRIES;
+PER_INTERP ulong TSTART, GSTART, RSTART, DSTART, DEND, SSTART, FSTART, FEND, MEMSIZE;
+PER_INTERP ulong SYMTAB_ENTRIES;
+/* With --gc=compact (GC_COMPACT on RISC-V) full collections are
+   mark-compact instead of copying, and the old generation gets all of
+   the heap that the nursery doesn't, less a sixty-fourth for the mark
+   tables (see compact). SEMIHEAPSIZE is then its size. */
+#ifdef GC_COMPACT
+char gc_compact = 1;
 #else
-#define MIDPOINT (MEMSIZE/2)
-#define DSTART 0
-#define SSTART (MIDPOINT - 16)
-#define HSTART (MIDPOINT)
-#define HEAPSIZE (MEMSIZE/2)
-#define SEMIHEAPSIZE (HEAPSIZE/2)
-#define STACKSIZE (MEMSIZE/2)
+char gc_compact = 0;
 #endif
+#define YOUNG_WORDS ((NURSERYSIZE/16 + 63)/64)
+// ^ words of mark bits for the nursery, which come first
+ulong compact_semi(ulong heapsize) {
+  return (ulong)ADDR_MASK(heapsize - NURSERYSIZE - heapsize/64 - 32);
+}
+ulong mark_words(ulong semi) {
+  return YOUNG_WORDS + (semi/16 + 63)/64;
+}
+void layout() {
+  NURSERYSIZE = (ulong)RND_UP(HEAPSIZE/8);
+  SEMIHEAPSIZE = gc_compact ? compact_semi(HEAPSIZE)
+                            : (ulong)RND_UP((HEAPSIZE - NURSERYSIZE)/2);
+  REMSET_ENTRIES = NURSERYSIZE/32;
+  SYMTAB_ENTRIES = MIN_SYMTAB_ENTRIES;
+  while (SYMTAB_ENTRIES < DICTSIZE/SYM_BYTES &&
+         SYMTAB_ENTRIES < MAX_SYMTAB_ENTRIES)
+    SYMTAB_ENTRIES *= 2;
+  TSTART = 0;
+  GSTART = (SYMTAB_ENTRIES * sizeof(char*));
+  RSTART = (SYMTAB_ENTRIES * (sizeof(char*) + 2*sizeof(ulong)));
+  DSTART = (RSTART + REMSET_ENTRIES * sizeof(ulong));
+  DEND = (ulong)RND_UP(DSTART + DICTSIZE);
+  SSTART = (ulong)RND_UP(DEND + STACKSIZE) - 16;
+  FSTART = SSTART + 16;
+  FEND = (ulong)RND_UP(FSTART + FRAMESIZE);
+  MEMSIZE = FEND;
+}
 
 /* must be 16byte aligned */
 #ifdef BAREMETAL
 extern char* MAINMEM;
-char *M;
-#else
-char M[MEMSIZE];
 #endif
+PER_INTERP char *M;
 
-
-ulong *SP, *root_env;
-char *DP;
+PER_INTERP ulong *SP, *root_env;
+PER_INTERP char *DP;
 
 typedef struct cell {
   ulong car;
   ulong cdr;
 } cell;
 typedef void (*stack_func)(void);
+struct prim_def {char* name; stack_func prim;};
+extern struct prim_def prims[];
+
+typedef struct gbinding {
+  char* sym;
+  ulong* val;
+} gbinding;
 
 #define CONS_TAG   0
 #define SYM_TAG    1
@@ -133,17 +208,259 @@ typedef void (*stack_func)(void);
 #define PRIM_TAG   4
 #define GC_FWD_TAG 5
 #define NIL_TAG    6
+#define HDR_TAG    7
+#define PC_TAG     8
+#define OP_TAG     9
+#define VEC_TAG    11
+#define BUF_TAG    12
+#define SIGIL_TAG  13
+
+/* Objects longer than one cell start with a header cell. FST of the
+   header holds the total number of cells (header included) and the
+   kind of object, SND is free for the kind to use. */
+#define HDR(ncells, kind) (((ulong)(ncells) << 8) | ((kind) << 4) | HDR_TAG)
+#define HDR_CELLS(h) (((ulong)(h)) >> 8)
+#define HDR_KIND(h) ((((ulong)(h)) >> 4) & 0xf)
+#define CODE_KIND 0
+#define ENV_KIND 1
+#define VEC_KIND 2
+#define BUF_KIND 3
+
+/* A code object is the threaded form of a proc body. SND of the
+   header is the list the code was compiled from, and each following
+   cell is an op: the opcode and the index of the cell within the code
+   object in FST, and a single operand word in SND. The index lets an
+   interior pointer to an op (see PC_TAG) find its way back to the
+   header. The last op is always OP_RET, and its operand is the number
+   of bindings the body makes with pope, which sizes the environment
+   frame of a call. */
+#define OP_WORD(idx, op) (((ulong)(idx) << 16) | ((op) << 4) | OP_TAG)
+#define OP_OF(w) ((((ulong)(w)) >> 4) & 0xfff)
+#define OP_IDX(w) ((((ulong)(w)) >> 16) & 0xffffff)
+#define OP_RET      0
+#define OP_NIL      1
+#define OP_INT      2
+#define OP_QSYM     3           /* quote of a symbol */
+#define OP_QUOTE    4           /* quote of anything else, operand is the cell */
+#define OP_CLOSURE  5           /* operand is a code object */
+#define OP_SYM      6
+#define OP_CELL     7           /* proc or prim cell baked into a body */
+#define OP_BADQUOTE 8
+#define OP_SPUSH    9           /* $sym, see SIGIL_TAG */
+#define OP_SPOPS    10          /* ^sym */
+#define OP_SPOPE    11          /* :sym */
+/* A symbol op that finds a symbol only ever bound at the top level
+   (see SYM_LOCAL) becomes OP_GSYM (or OP_GSYM_NEXT), which keeps the
+   index of the symbol's global binding in the top 24 bits of the op
+   word and goes straight there. If pope binds the symbol in a call
+   later, the op goes back to being what it was the next time it runs.
+   The operand is still the symbol. */
+#define OP_GSYM     12
+#define GSYM_WORD(w, slot)                                      \
+  (((ulong)(w) & 0xffffffffffULL) | ((ulong)(slot) << 40))
+#define OP_GSLOT(w) (((ulong)(w)) >> 40)
+/* Superinstructions, which compile_body makes of the commonest pairs
+   of ops (see fused_op). Each is the first op of its pair with the
+   same operand, and after running it goes straight on to the op in the
+   next cell, which is left as it was, without a trip back around the
+   eval loop. */
+#define OP_INT_NEXT     13
+#define OP_SYM_NEXT     14
+#define OP_GSYM_NEXT    15
+#define OP_SPUSH_NEXT   16
+#define OP_SPOPE_NEXT   17
+#define OP_CLOSURE_NEXT 18
+#define N_OPS           19
+/* The SND of a PRIM_TAG cell is the index of the primitive in prims[],
+   and eval runs primitive i as opcode PRIM_OP(i). The first few are
+   common enough to be handled in eval itself, and the rest are called
+   through the table. A primitive from an image that this build doesn't
+   have becomes PRIM_MISSING. */
+#define PRIM_OP(i) (N_OPS + (i))
+#define PRIM_PUSH   0
+#define PRIM_PUSHR  1
+#define PRIM_POPR   2
+#define PRIM_EQ     3
+#define PRIM_CAR    4
+#define PRIM_CDR    5
+#define PRIM_CSWAP  6
+#define PRIM_DUP    7
+#define PRIM_DROP   8
+#define PRIM_ADD    9
+#define PRIM_SUB    10
+#define PRIM_MUL    11
+#define N_INLINE_PRIMS 12
+#define MAX_PRIMS   64
+#define PRIM_MISSING MAX_PRIMS
+#define IS_SYM_OP(op)                                                   \
+  ((op) == OP_SYM || (op) == OP_SYM_NEXT ||                             \
+   (op) == OP_GSYM || (op) == OP_GSYM_NEXT)
+/* the first of a pair that goes on to the op in the next cell */
+#define IS_FUSED(op) ((op) >= OP_INT_NEXT && (op) < N_OPS)
+#define IS_CODE(p) (TAG_MASK(FST(p)) == HDR_TAG)
+#define PROC_SRC(p)                                                     \
+  (IS_CODE(ADDR_MASK(FST(p))) ? SND(ADDR_MASK(FST(p))) : FST(p))
+
+/* An environment frame holds the bindings pope makes during a
+   call. SND of the header is the enclosing environment, either another
+   frame or root_env. The next cell holds the number of slots in use and
+   whether a closure has captured the frame. Then come the symbols of
+   the slots, two to a cell, and then the value of each slot, one cell
+   each, laid out like a stack slot. Once a frame is captured it no
+   longer grows, and later popes go into a new frame in front of it, so
+   a closure never sees bindings made after it was created but does
+   see pops change the ones it shares. */
+#define IS_ENV(e)                                                       \
+  (TAG_MASK(FST(e)) == HDR_TAG && HDR_KIND(FST(e)) == ENV_KIND)
+#define ENV_CELLS(nslots) (2 + (nslots)/2 + (nslots))
+#define ENV_SLOTS(e) ((HDR_CELLS(FST(e)) - 2) / 3 * 2)
+#define ENV_USED(e) FST((e)+2)
+#define ENV_SEALED(e) SND((e)+2)
+#define ENV_SYMS(e) ((char**)((e)+4))
+#define ENV_VAL(e, i) ((e) + 4 + ENV_SLOTS(e) + 2*(i))
+#define ENV_MIN_SLOTS 2
+#define SEAL_ENV(e)                                             \
+  if (IS_ENV(e) && !ENV_SEALED((ulong*)(e))) {                  \
+    ENV_SEALED((ulong*)(e)) = 1;                                \
+    CHANGE_BARRIER(e);                                          \
+  }
 
-cell return_stack = {NIL_TAG,0};
-ulong depth = 0;
-cell read_stack;
+/* A vector is a header and then its elements, one cell each, laid out
+   like a stack slot. Its value is VEC_TAG with the header in SND, so a
+   cell holding one is traced like a cons with no car. */
+#define VEC_LEN(v) (HDR_CELLS(FST(v)) - 1)
+#define VEC_REF(v, i) ((v) + 2 + 2*(i))
+
+/* A byte buffer is a header with the length in bytes in SND, and then
+   the bytes themselves, which the collectors copy but never look
+   at. Its value is BUF_TAG with the header in SND, like a vector. */
+#define BUF_CELLS(nbytes) (1 + ((nbytes) + 15)/16)
+#define BUF_LEN(b) SND(b)
+#define BUF_DATA(b) ((unsigned char*)((b) + 2))
+
+/* The reader turns 'x, $x, ^x and :x into a single value rather than
+   spelling them out as quote x, quote x push and so on, so that they
+   take one cell of a body and compile to one op that doesn't look up
+   push, pops or pope. The value is SIGIL_TAG with the kind above it,
+   and the symbol in SND. Anything but a symbol after the sigil is
+   still spelled out. */
+#define SIGIL_QUOTE 0
+#define SIGIL_PUSH 1
+#define SIGIL_POPS 2
+#define SIGIL_POPE 3
+#define SIGIL(kind) (((ulong)(kind) << 4) | SIGIL_TAG)
+#define SIGIL_KIND(w) ((((ulong)(w)) >> 4) & 0x3)
+#define SIGIL_CHARS "'$^:"
+
+/* Immediates. A car, a cdr or a global binding normally points at a
+   cell holding the value, but ints that fit in 58 bits, symbols and
+   nil are stored in the word itself instead, and need no cell at
+   all, and so are sigils. Cells are 16 byte aligned, so an immediate
+   is told apart from a pointer by its tag. The kind sits above the tag
+   and the value above that, with a symbol stored as its offset into
+   the dictionary so that images can be loaded somewhere else, and a
+   sigil as that offset shifted up past its kind. A cons whose car is
+   immediate has IMM_TAG rather than CONS_TAG in FST, which VAL_TAG
+   hides. */
+#define IMM_TAG    10
+#define IMM_INT 0
+#define IMM_SYM 1
+#define IMM_NIL 2
+#define IMM_SIGIL 3
+#define IMM(kind, v) (((ulong)(v) << 6) | ((kind) << 4) | IMM_TAG)
+#define IMM_KIND(w) ((((ulong)(w)) >> 4) & 0x3)
+#define IMM_VAL(w) ((long long)(w) >> 6)
+#define IS_IMM(w) (TAG_MASK(w) == IMM_TAG)
+#define VAL_TAG(w) (IS_IMM(w) ? CONS_TAG : TAG_MASK(w))
+#define IS_PAIR(r) (!IS_IMM(r) && VAL_TAG(FST(r)) == CONS_TAG)
+
+ulong immediate(ulong car, ulong cdr) {
+  /* The immediate form of the value (car, cdr), or zero if it needs a
+     cell. */
+  switch (TAG_MASK(car)) {
+  case INT_TAG:
+    return (IMM_VAL(cdr << 6) == (long long)cdr) ? IMM(IMM_INT, cdr) : 0;
+  case SYM_TAG:
+    if ((char*)cdr < M+DSTART || (char*)cdr >= M+DEND) return 0;
+    return IMM(IMM_SYM, (char*)cdr - (M+DSTART));
+  case NIL_TAG:
+    return IMM(IMM_NIL, 0);
+  case SIGIL_TAG:
+    if ((char*)cdr < M+DSTART || (char*)cdr >= M+DEND) return 0;
+    return IMM(IMM_SIGIL, (((char*)cdr - (M+DSTART)) << 2) | SIGIL_KIND(car));
+  default:
+    return 0;
+  }
+}
+cell deref(ulong* r) {
+  /* The value a car, cdr or global binding refers to, laid out like a
+     stack slot. */
+  cell c = {NIL_TAG, 0};
+  if (!IS_IMM(r)) {
+    c.car = FST(r);
+    c.cdr = SND(r);
+  } else if (IMM_KIND(r) == IMM_INT) {
+    c.car = INT_TAG;
+    c.cdr = IMM_VAL(r);
+  } else if (IMM_KIND(r) == IMM_SYM) {
+    c.car = SYM_TAG;
+    c.cdr = (ulong)(M+DSTART) + IMM_VAL(r);
+  } else if (IMM_KIND(r) == IMM_SIGIL) {
+    c.car = SIGIL(IMM_VAL(r) & 0x3);
+    c.cdr = (ulong)(M+DSTART) + (IMM_VAL(r) >> 2);
+  }
+  return c;
+}
 
-#define PROC (ADDR_MASK(return_stack.car))
+PER_INTERP ulong depth = 0;
+
+/* Counters for the vmstats primitive and the summary at exit. Times
+   are in nanoseconds and sizes in bytes. */
+struct stats {
+  ulong conses, objs;
+  ulong minor_gcs, full_gcs, grows;
+  ulong copied;
+  ulong minor_seen, minor_kept;     /* nursery in use, and promoted */
+  ulong full_seen, full_kept;       /* heap in use, and surviving */
+  ulong pause_total, pause_max;
+  ulong incr_cycles, incr_steps;    /* see gc_step */
+  ulong step_pause_max, pauses_over;
+  ulong ops[N_OPS];
+  ulong fused;                      /* ops run without a dispatch */
+#ifdef OP_PAIRS
+  ulong pairs[N_OPS][N_OPS];        /* by the op dispatched before */
+  ulong last_op;
+#endif
+  ulong installs, tail_calls;
+  ulong max_depth;
+  ulong* min_sp;
+  ulong start_ns;
+  /* filled in by update_stats */
+  ulong minor_survival, full_survival, pause_avg, peak_stack;
+  ulong total_ops, run_ns, semispace_bytes;
+};
+PER_INTERP struct stats stats;
+char stats_at_exit = 0;
+PER_INTERP cell read_stack;
+
+/* The return stack is a contiguous array of frames at FSTART, growing
+   up, with FP pointing at the current one. A frame is a PC_TAG pointer
+   to the next op to run and the environment, laid out like a cell. The
+   bottom frame is a NIL_TAG sentinel, so the return stack is empty
+   when FP is back down to it. */
+PER_INTERP ulong* FP;
+#define FRAME_BASE ((ulong*)(M+FSTART))
+#define PROC FP
 #define ENV (&SND(PROC))
-#define BODY (FST(PROC))
-#define CUR (FST(BODY))
-#define INC_PC FST(return_stack.car) = (ulong)(SND(FST(return_stack.car))) | PROC_TAG
-
+#define PC (ADDR_MASK(FST(PROC)))
+#define OP (OP_OF(FST(PC)))
+#define ARG (SND(PC))
+#define INC_PC FST(PROC) += 2*sizeof(ulong)
+/* the frame pushed by the repl for each top level form */
+#define TOPLEVEL (depth == 1)
+
+void to_frame(void);
+void push_frame(void);
 #define INSTALL(cnt)                                                    \
   /* expects a proc */                                                  \
   /* explicity copy of the children of cnt to prevent mutation */       \
@@ -151,111 +468,495 @@ cell read_stack;
   ulong _a = FST(cnt), _b = SND(cnt);                                   \
   /* ^ safe if cnt is unreachable or on the stack */                    \
   PUSH(_a, _b);                                                         \
-  if ((return_stack.car != NIL_TAG) &&                                  \
-      (FST(SND(BODY)) == NIL_TAG) &&                                    \
-      (FST(return_stack.cdr) != NIL_TAG)) {                             \
+  to_frame();                                                           \
+  ++stats.installs;                                                     \
+  if ((FP > FRAME_BASE + 2) &&                                          \
+      (OP_OF(FST(PC+2)) == OP_RET)) {                                   \
     /* tail call and not the root or first call */                      \
-    ulong* h = new_cons(FST(SP), SND(SP));                              \
-    return_stack.car = h;                                               \
+    ++stats.tail_calls;                                                 \
+    FST(FP) = SP[0];                                                    \
+    SND(FP) = SP[1];                                                    \
     SP+=2;                                                              \
   } else {                                                              \
-  ulong* h = new_cons(SP[0], SP[1]);                                    \
-  SP[0] = (ulong)h | CONS_TAG;                                          \
-  h = new_cons(return_stack.car, return_stack.cdr);                     \
-  SP[1] = h;                                                            \
-  ++depth;                                                              \
-  return_stack.car = FST(SP);                                           \
-  return_stack.cdr = SND(SP);                                           \
-  SP+=2;                                                                \
+    push_frame();                                                       \
   }
 
 #define PUSH(a,b)                               \
   *(--SP) = b;                                  \
   *(--SP) = a
 
+/* Everything print writes goes through a buffer, which is handed to
+   stdout (or putchar on RISC-V) when it fills, when the flush
+   primitive runs, when the repl is about to wait for a new line, and
+   at exit. Errors are not buffered, but flush what came before them
+   to keep things in order. */
+#define OUTBUF_SIZE 0x2000
+PER_INTERP char outbuf[OUTBUF_SIZE];
+PER_INTERP ulong outbuf_len = 0;
+#ifndef BAREMETAL
+/* A batch job (see run_batch) keeps everything it prints until it is
+   done, and ends through job_exit rather than exiting the process. */
+ulong batch_jobs = 0;
+PER_INTERP char* job_path;
+PER_INTERP jmp_buf* job_exit;
+PER_INTERP char* job_out;
+PER_INTERP ulong job_out_len, job_out_cap;
+#endif
+void flush_output(void) {
+#ifndef BAREMETAL
+  if (batch_jobs) {
+    if (job_out_len + outbuf_len > job_out_cap) {
+      job_out_cap = 2*(job_out_len + outbuf_len);
+      job_out = realloc(job_out, job_out_cap);
+      if (!job_out) {
+        fputs("Out of memory for a job's output!\n", stderr);
+        exit(1);
+      }
+    }
+    memcpy(job_out + job_out_len, outbuf, outbuf_len);
+    job_out_len += outbuf_len;
+  } else {
+    fwrite(outbuf, 1, outbuf_len, stdout);
+    fflush(stdout);
+  }
+#else
+  for (ulong i = 0; i < outbuf_len; ++i) putchar(outbuf[i]);
+#endif
+  outbuf_len = 0;
+}
+void out_char(char c) {
+  if (outbuf_len == OUTBUF_SIZE) flush_output();
+  outbuf[outbuf_len++] = c;
+}
+void out_bytes(char* b, ulong len) {
+  if (outbuf_len + len > OUTBUF_SIZE) flush_output();
+  for (ulong i = 0; i < len; ++i) outbuf[outbuf_len++] = b[i];
+}
+void out_string(char* str) {
+  while (*str) out_char(*str++);
+}
+
+/* panic never returns, on RISC-V or here, so the compiler needn't
+   worry about what comes after one */
 #ifdef BAREMETAL
 extern void print_err(char*);
-extern void panic(char* msg);
+extern void panic(char* msg) __attribute__((noreturn));
+/* there is nothing to exit to */
+#define quit panic
 #else
-void print_err(char* msg) {fputs(msg, stderr);}
+void print_err(char* msg) {
+  flush_output();
+  fputs(msg, stderr);
+}
+void panic(char* msg) __attribute__((noreturn));
 void panic(char* msg) {
   print_err(msg);
+  if (job_exit) longjmp(*job_exit, 2);
   while (1) {}
 }
+/* For what is wrong before anything has run, like a bad flag, where
+   there is nothing to look at in a debugger: just say so and exit. */
+void quit(char* msg) __attribute__((noreturn));
+void quit(char* msg) {
+  print_err(msg);
+  if (job_exit) longjmp(*job_exit, 2);
+  exit(1);
+}
 #endif
 
-SANITY(char* logfilename = "mdump.dot";
-       FILE* logfilefd;
+SANITY(PER_INTERP char* logfilename = "mdump.dot";
+       PER_INTERP FILE* logfilefd;
 
        void emit_node(ulong* obj, char* color) {
          switch (TAG_MASK(FST(obj))) {
          case SYM_TAG:
-           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"%s\"]\n", obj, color, (char*)SND(obj));
+           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"%s\"]\n", (ulong)obj, color, (char*)SND(obj));
+           break;
+         case SIGIL_TAG:
+           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"%c%s\"]\n", (ulong)obj, color,
+                   SIGIL_CHARS[SIGIL_KIND(FST(obj))], (char*)SND(obj));
            break;
          case INT_TAG:
-           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"INT %llx\"]\n", obj, color, SND(obj));
+           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"INT %llx\"]\n", (ulong)obj, color, SND(obj));
            break;
          case PRIM_TAG:
-           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"PRIM\"]\n", obj, color);
+           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"PRIM\"]\n", (ulong)obj, color);
            break;
          case NIL_TAG:
-           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"NIL\"]\n", obj, color);
+           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"NIL\"]\n", (ulong)obj, color);
            break;
          case CONS_TAG:
+         case IMM_TAG:
+         case VEC_TAG:
+         case BUF_TAG:
          case PROC_TAG:
            fprintf(logfilefd, "\"%llx\" [color=%s, label=\"%s %llx\"]\n",
-                   obj,
+                   (ulong)obj,
                    color,
-                   (TAG_MASK(FST(obj)) == CONS_TAG) ? "CONS" : "PROC",
-                   obj);
+                   (VAL_TAG(FST(obj)) == CONS_TAG) ? "CONS"
+                   : (VAL_TAG(FST(obj)) == VEC_TAG) ? "VEC"
+                   : (VAL_TAG(FST(obj)) == BUF_TAG) ? "BUF" : "PROC",
+                   (ulong)obj);
+           break;
+         case HDR_TAG:
+           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"%s %llx\"]\n",
+                   (ulong)obj, color,
+                   (HDR_KIND(FST(obj)) == ENV_KIND) ? "ENV"
+                   : (HDR_KIND(FST(obj)) == VEC_KIND) ? "VEC"
+                   : (HDR_KIND(FST(obj)) == BUF_KIND) ? "BUF" : "CODE",
+                   HDR_CELLS(FST(obj)));
+           break;
+         case PC_TAG:
+           fprintf(logfilefd, "\"%llx\" [color=%s, label=\"FRAME %llx\"]\n", (ulong)obj, color, (ulong)obj);
            break;
          case GC_FWD_TAG:
            panic("emit called on garbage collection forward pointer!");
          }
        }
        )
-ulong *tospace, *fromspace, *HP;
+ulong now_ns() {
+#ifdef BAREMETAL
+  /* the qemu virt timer runs at 10MHz */
+  ulong t;
+  asm volatile ("rdtime %0" : "=r"(t));
+  return t * 100;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+#ifndef GC_PAUSE_NS
+#define GC_PAUSE_NS 0
+#endif
+ulong gc_pause_limit = GC_PAUSE_NS;
+#if defined(GC_COMPACT) && GC_PAUSE_NS
+#error "GC_PAUSE_NS needs the copying collector"
+#endif
+// ^ set by --gc-pause on linux; zero keeps full collections in one go
+ulong gc_pause(ulong start) {
+  ulong t = now_ns() - start;
+  stats.pause_total += t;
+  if (t > stats.pause_max) stats.pause_max = t;
+  if (gc_pause_limit && t > gc_pause_limit) ++stats.pauses_over;
+  return t;
+}
+
+/* New objects are bump allocated at YP in the nursery. Minor
+   collections promote whatever is still reachable there into the old
+   generation at HP, which is itself a pair of Cheney semispaces that
+   full collections flip between. */
+PER_INTERP ulong *tospace, *fromspace, *HP;
+PER_INTERP ulong *nursery, *YP;
+PER_INTERP char gc_minor = 0;
+#define NURSERY_END ((ulong*)((char*)nursery + NURSERYSIZE))
+#define IN_NURSERY(p) ((ulong*)(p) >= nursery && (ulong*)(p) < NURSERY_END)
+PER_INTERP ulong* ylimit;
+// ^ allocation past here calls make_room, NURSERY_END unless a cycle runs
+
+/* Incremental cycles. With --gc-pause, the old generation is
+   collected a step at a time instead of all at once. A cycle copies
+   everything reachable into tospace in small steps taken from the
+   allocator, while the program keeps running on the originals in
+   fromspace, and finishes with a flip at the end of a minor
+   collection that points the roots at the copies. The originals are
+   never overwritten with forwarding pointers, so the program can't
+   notice the copies until then; instead fwdtab maps each cell of
+   fromspace to its copy. What the program changes in the meantime is
+   caught by the write barrier: every old cell written to is in the
+   remembered set at the next minor collection, which recopies it if
+   it has been copied already. After the flip, the steps go on to
+   clear fwdtab for the next cycle. */
+#define GC_IDLE 0
+#define GC_COPYING 1
+#define GC_CLEARING 2
+PER_INTERP char gc_phase = GC_IDLE;
+PER_INTERP char gc_replica = 0;
+// ^ copy makes copies for the cycle, rather than forwarding
+PER_INTERP ulong *fwdtab, *TP, *tscan;
+PER_INTERP ulong fwd_clear, fwd_dirty;
+// ^ the entries of fwdtab still to be cleared
+#define GC_START_ROOM (NURSERYSIZE + NURSERYSIZE/2)
+// ^ start a cycle once a semispace has less room than this left, which
+//   leaves it half a nursery of promotions to finish in
+#define GC_STEP_RATIO 2
+// ^ cells of work a step does for every cell allocated before it
+#define GC_STEP_MIN 64
+// ^ cells allocated between steps at the least
+
+/* The remembered set is a store buffer of old locations that may point
+   into the nursery, filled by WRITE_BARRIER. Entries are either a cell
+   (16 byte aligned) or a single pointer word outside the heap, such as
+   a genv value, which is marked by bit 3 of the address. If it ever
+   fills up, the next collection is a full one. */
+PER_INTERP ulong remset_top = 0;
+PER_INTERP char remset_overflow = 0;
+void remember(ulong addr) {
+  ulong* remset = (ulong*)(M+RSTART);
+  if (remset_top && remset[remset_top-1] == addr) return;
+  if (remset_top == REMSET_ENTRIES) {
+    remset_overflow = 1;
+    return;
+  }
+  remset[remset_top++] = addr;
+}
+#define WRITE_BARRIER(cell)                                     \
+  if (!IN_NURSERY(cell)) remember((ulong)ADDR_MASK(cell))
+#define WRITE_BARRIER_WORD(slot)                                \
+  remember((ulong)(slot))
+/* Stores of something other than a pointer (a byte, a count, a flag)
+   don't matter to minor collections, only to the copies made by an
+   incremental cycle. */
+#define CHANGE_BARRIER(obj)                                     \
+  if (gc_phase == GC_COPYING && !IN_NURSERY(obj))               \
+    remember((ulong)ADDR_MASK(obj))
+
+/* Roots held by C code. When a C local must keep pointing at a heap
+   object across an allocation, its address is registered here between
+   ROOTS_BEGIN and ROOTS_END, and the collectors update the local in
+   place. The address taken also keeps the compiler from caching the
+   local in a register across the call. ROOT_WORD registers a single
+   word, which is either a plain pointer or a tagged one. ROOT_CELL
+   registers a car/cdr pair laid out like a stack slot, whose car tag
+   says what the cdr is. Cell entries are marked by bit 0 of the
+   address. */
+#define MAX_C_ROOTS 64
+PER_INTERP ulong c_roots[MAX_C_ROOTS];
+PER_INTERP ulong c_roots_top = 0;
+#define ROOTS_BEGIN ulong _roots_mark = c_roots_top
+#define ROOTS_END c_roots_top = _roots_mark
+#define ROOT_WORD(w)                                            \
+  ASSERT(c_roots_top < MAX_C_ROOTS, "Too many C roots!");       \
+  c_roots[c_roots_top++] = (ulong)&(w)
+#define ROOT_CELL(c)                                            \
+  ASSERT(c_roots_top < MAX_C_ROOTS, "Too many C roots!");       \
+  c_roots[c_roots_top++] = (ulong)&(c) | 1
+
+/* Mark-compact. Full collections mark everything reachable in a
+   bitmap with a bit for every cell, and then slide it all down to the
+   bottom of the old generation, in the order it was allocated, with
+   the survivors of the nursery after. Where an object ends up is the
+   number of cells marked before it, which markoffs keeps for the
+   start of each word of the bitmap, so nothing is ever written into
+   the objects themselves. Marking and updating pointers reuse the
+   scans of the copying collector, with copy marking in one and
+   returning the new address in the other. The mark stack is the
+   remembered set, which a full collection has no use for. If it fills
+   up, every marked object is scanned again until nothing new is
+   found. */
+#define COMPACT_MARK 1
+#define COMPACT_UPDATE 2
+PER_INTERP char gc_compacting = 0;
+PER_INTERP ulong *markbits, *markoffs;
+PER_INTERP ulong mark_top;
+PER_INTERP char mark_overflow;
+#define IN_USE(p)                                                       \
+  (IN_NURSERY(p) ? (ulong*)(p) < YP : (ulong*)(p) >= fromspace && (ulong*)(p) < HP)
+
+ulong bit_count(ulong w) {
+  /* there is no popcount to count on with RISC-V */
+  w = w - ((w >> 1) & 0x5555555555555555ULL);
+  w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+  w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (w * 0x0101010101010101ULL) >> 56;
+}
+#define LOW_BIT(w) bit_count(((w) & -(w)) - 1)
+
+ulong mark_index(ulong* p) {
+  if (IN_NURSERY(p)) return (p - nursery)/2;
+  return 64*YOUNG_WORDS + (p - fromspace)/2;
+}
+ulong* marked_cell(ulong i) {
+  if (i < 64*YOUNG_WORDS) return nursery + 2*i;
+  return fromspace + 2*(i - 64*YOUNG_WORDS);
+}
+
+ulong* mark(ulong* obj) {
+  /* Marks every cell of the object at obj, and pushes it to have its
+     children marked. */
+  if (!IN_USE(obj)) return obj;
+  ulong i = mark_index(obj);
+  if (markbits[i/64] & (1ULL << (i%64))) return obj;
+  ulong ncells = IS_CODE(obj) ? HDR_CELLS(FST(obj)) : 1;
+  for (ulong j = i; j < i + ncells; ++j) markbits[j/64] |= 1ULL << (j%64);
+  if (mark_top < REMSET_ENTRIES) ((ulong*)(M+RSTART))[mark_top++] = (ulong)obj;
+  else mark_overflow = 1;
+  return obj;
+}
+
+ulong* compacted(ulong* obj) {
+  /* Where the marked object at obj is slid to. */
+  if (!IN_USE(obj)) return obj;
+  ulong i = mark_index(obj);
+  ulong below = markbits[i/64] & ((1ULL << (i%64)) - 1);
+  return fromspace + 2*(markoffs[i/64] + bit_count(below));
+}
+
+ulong* replicate(ulong* obj) {
+  /* The copy of the old object at obj made by the running cycle,
+     making it first if there isn't one. Every cell of the original
+     maps to the matching cell of the copy. */
+  if (obj < fromspace || obj >= HP) return obj;
+  ulong* r = (ulong*)fwdtab[(obj - fromspace)/2];
+  if (r) return r;
+  ulong ncells = IS_CODE(obj) ? HDR_CELLS(FST(obj)) : 1;
+  r = TP;
+  stats.copied += 2*ncells*sizeof(ulong);
+  for (ulong i = 0; i < 2*ncells; ++i) TP[i] = obj[i];
+  for (ulong i = 0; i < ncells; ++i)
+    fwdtab[(obj - fromspace)/2 + i] = (ulong)(r + 2*i);
+  TP += 2*ncells;
+  return r;
+}
+
 ulong* copy(ulong* obj) {
-  if (HP+2 >= fromspace + (SEMIHEAPSIZE / sizeof(ulong))) panic("OOM!\n");
   if (!obj) return obj;         /* NULL is valid */
+  if (IS_IMM(obj)) return obj;
+  if (gc_replica) return replicate(obj);
+  if (gc_compacting) return gc_compacting == COMPACT_MARK ? mark(obj) : compacted(obj);
+  if (gc_minor && !IN_NURSERY(obj)) return obj;
   if (TAG_MASK(FST(obj)) == GC_FWD_TAG) return SND(obj);
-  SANITY(
-         fprintf(logfilefd, "subgraph {\n");
-         fprintf(logfilefd, "subgraph {\n");
-         emit_node(obj, "red");
-         );
+  ulong ncells = IS_CODE(obj) ? HDR_CELLS(FST(obj)) : 1;
+  if (HP+2*ncells >= fromspace + (SEMIHEAPSIZE / sizeof(ulong))) panic("OOM!\n");
+  SANITY(if (!gc_minor) {
+           fprintf(logfilefd, "subgraph {\n");
+           fprintf(logfilefd, "subgraph {\n");
+           emit_node(obj, "red");
+         });
   ulong* newaddr = HP;
-  FST(HP) = FST(obj);
-  SND(HP) = SND(obj);
-  HP += 2;
+  stats.copied += 2*ncells*sizeof(ulong);
+  for (ulong i = 0; i < 2*ncells; ++i) HP[i] = obj[i];
+  HP += 2*ncells;
   FST(obj) = GC_FWD_TAG;
   SND(obj) = newaddr;
 
-  SANITY(
+  SANITY(if (!gc_minor) {
          emit_node(newaddr, "black");
          fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=green];\n}\n",
                  (ulong)obj,
                  (ulong)newaddr);
          ulong tag = TAG_MASK(FST(newaddr));
-         if (tag == CONS_TAG || tag == PROC_TAG) {
+         if (tag == CONS_TAG || tag == PROC_TAG || tag == PC_TAG) {
            fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=\"red:magenta\"];\n",
                    (ulong)obj,
-                   ADDR_MASK(FST(newaddr)));
+                   (ulong)ADDR_MASK(FST(newaddr)));
            fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=\"red:royalblue\"];\n",
                    (ulong)obj,
-                   ADDR_MASK(SND(newaddr)));
+                   (ulong)ADDR_MASK(SND(newaddr)));
          }
          fprintf(logfilefd, "}\n");
-         );
+         });
   return newaddr;
 }
 
+ulong forward(ulong w) {
+  /* Copies the target of a tagged pointer word, returning a word with
+     the same tag pointing at the copy. */
+  ulong tag = TAG_MASK(w);
+  if (tag == IMM_TAG) return w;
+  if (tag == PC_TAG) {
+    /* interior pointer into a code object, the op knows its index */
+    ulong* pc = ADDR_MASK(w);
+    ulong idx = OP_IDX(FST(pc));
+    return (ulong)(copy(pc - 2*idx) + 2*idx) | PC_TAG;
+  }
+  return (ulong)copy(ADDR_MASK(w)) | tag;
+}
+
+/* A cycle copies what the roots point at before the flip without
+   pointing the roots at the copies, so the scans of the roots take
+   update, and leave the roots alone without it. */
+#define SET_ROOT(root, val)                     \
+  ({ulong _v = (ulong)(val); if (update) (root) = _v;})
+
+void scan_c_roots(char update) {
+  for (ulong i = 0; i < c_roots_top; ++i) {
+    ulong* root = (ulong*)(c_roots[i] & ~1ULL);
+    ulong tag = TAG_MASK(root[0]);
+    if (tag != CONS_TAG && tag != PROC_TAG && tag != PC_TAG &&
+        tag != IMM_TAG && tag != VEC_TAG && tag != BUF_TAG) continue;
+    SET_ROOT(root[0], forward(root[0]));
+    if (c_roots[i] & 1) SET_ROOT(root[1], copy(root[1]));
+  }
+}
+
+void scan_roots(char update) {
+  /* The roots outside the heap, other than the global environment. */
+  SET_ROOT(root_env, copy(root_env));
+  if (TAG_MASK(read_stack.car) == CONS_TAG) {
+    SET_ROOT(read_stack.car, copy(read_stack.car));
+    SET_ROOT(read_stack.cdr, copy(read_stack.cdr));
+  }
+  for (ulong* f = FRAME_BASE + 2; f <= FP; f += 2) {
+    SET_ROOT(FST(f), forward(FST(f)));
+    SET_ROOT(SND(f), copy(SND(f)));
+  }
+  for (ulong* a = (ulong*)(M+SSTART-16); a >= (ulong*)SP; a-=2) {
+    ulong tag = TAG_MASK(FST(a));
+    if (tag == CONS_TAG || tag == PROC_TAG || tag == PC_TAG ||
+        tag == IMM_TAG || tag == VEC_TAG || tag == BUF_TAG) {
+      SET_ROOT(FST(a), forward(FST(a)));
+      SET_ROOT(SND(a), copy(SND(a)));
+    }
+  }
+  scan_c_roots(update);
+}
+
+ulong scan_cell(ulong*);
+void scan_object(ulong* obj) {
+  /* Copies the children of a multi-cell object already in tospace. */
+  switch (HDR_KIND(FST(obj))) {
+  case CODE_KIND:
+    SND(obj) = copy(SND(obj));
+    for (ulong i = 1; i < HDR_CELLS(FST(obj)); ++i) {
+      ulong* op = obj + 2*i;
+      switch (OP_OF(FST(op))) {
+      case OP_QUOTE:
+      case OP_CLOSURE:
+      case OP_CLOSURE_NEXT:
+      case OP_CELL:
+        SND(op) = copy(SND(op));
+        break;
+      }
+    }
+    break;
+  case ENV_KIND:
+    SND(obj) = copy(SND(obj));
+    for (ulong i = 0; i < ENV_USED(obj); ++i) {
+      ulong* v = ENV_VAL(obj, i);
+      ulong tag = TAG_MASK(FST(v));
+      if (tag == CONS_TAG || tag == PROC_TAG || tag == PC_TAG ||
+          tag == IMM_TAG || tag == VEC_TAG || tag == BUF_TAG) {
+        FST(v) = forward(FST(v));
+        SND(v) = copy(SND(v));
+      }
+    }
+    break;
+  case VEC_KIND:
+    for (ulong i = 0; i < VEC_LEN(obj); ++i) scan_cell(VEC_REF(obj, i));
+    break;
+  case BUF_KIND:
+    break;
+  default:
+    panic("Unknown object kind in collect!");
+  }
+}
+
+void drop_cycle();
+void compact();
 void collect() {
+  drop_cycle();
+  if (gc_compact) {
+    compact();
+    return;
+  }
   SANITY(
          print_err("GC!\n");
          logfilefd = fopen(logfilename, "w+");
          fwrite("digraph {\n", 1, 10, logfilefd);
          );
+  ulong start = now_ns();
+  stats.full_seen += ((char*)HP - (char*)fromspace) + ((char*)YP - (char*)nursery);
   ulong* scan;
   ulong* hold = fromspace;
   fromspace = tospace;
@@ -266,11 +967,22 @@ void collect() {
   SANITY(
          fprintf(logfilefd, "subgraph {\n");
          fprintf(logfilefd, "subgraph {\n");
-         fprintf(logfilefd, "root_env;\nroot_env -> \"%llx\" [color=red];\n", root_env);
+         fprintf(logfilefd, "root_env;\nroot_env -> \"%llx\" [color=red];\n", (ulong)root_env);
          );
   root_env = copy(root_env);
   SANITY(
-         fprintf(logfilefd, "root_env -> \"%llx\";\n", root_env);
+         fprintf(logfilefd, "root_env -> \"%llx\";\n", (ulong)root_env);
+         fprintf(logfilefd, "}\n");
+         fprintf(logfilefd, "subgraph {\n");
+         fprintf(logfilefd, "genv;\n");
+         );
+  for (gbinding* b = (gbinding*)(M+GSTART); b < (gbinding*)(M+RSTART); ++b) {
+    if (!b->sym) continue;
+    SANITY(fprintf(logfilefd, "genv -> \"%llx\" [color=red, label=\"%s\"];\n", (ulong)b->val, b->sym));
+    b->val = copy(b->val);
+    SANITY(fprintf(logfilefd, "genv -> \"%llx\" [label=\"%s\"];\n", (ulong)b->val, b->sym));
+  }
+  SANITY(
          fprintf(logfilefd, "}\n");
          fprintf(logfilefd, "subgraph {\n");
          );
@@ -283,13 +995,14 @@ void collect() {
     SANITY(fprintf(logfilefd, "readstack -> \"%llx\" [color=\"black:royalblue\"];\n", read_stack.cdr));
   }
 
-  if (TAG_MASK(return_stack.car) == CONS_TAG) {
-    SANITY(fprintf(logfilefd, "return_stack;\nreturn_stack -> \"%llx\" [color=\"red:magenta\"];\n", return_stack.car));
-    SANITY(fprintf(logfilefd, "return_stack -> \"%llx\" [color=\"red:royalblue\"];\n", return_stack.cdr));
-    return_stack.car = copy(return_stack.car);
-    return_stack.cdr = copy(return_stack.cdr);
-    SANITY(fprintf(logfilefd, "return_stack -> \"%llx\" [color=\"black:magenta\"];\n", return_stack.car));
-    SANITY(fprintf(logfilefd, "return_stack -> \"%llx\" [color=\"black:royalblue\"];\n", return_stack.cdr));
+  SANITY(fprintf(logfilefd, "return_stack;\n"));
+  for (ulong* f = FRAME_BASE + 2; f <= FP; f += 2) {
+    SANITY(fprintf(logfilefd, "return_stack -> \"%llx\" [color=\"red:magenta\"];\n", (ulong)ADDR_MASK(FST(f))));
+    SANITY(fprintf(logfilefd, "return_stack -> \"%llx\" [color=\"red:royalblue\"];\n", SND(f)));
+    FST(f) = forward(FST(f));
+    SND(f) = copy(SND(f));
+    SANITY(fprintf(logfilefd, "return_stack -> \"%llx\" [color=\"black:magenta\"];\n", (ulong)ADDR_MASK(FST(f))));
+    SANITY(fprintf(logfilefd, "return_stack -> \"%llx\" [color=\"black:royalblue\"];\n", SND(f)));
   }
 
   SANITY(
@@ -313,10 +1026,14 @@ void collect() {
          );
   for (ulong* a = (ulong*)(M+SSTART-16); a >= (ulong*)SP; a-=2) {
     ulong tag = TAG_MASK(FST(a));
-    ulong idx = (a-SP)/2;
+    SANITY(ulong idx = (a-SP)/2;)
     switch (tag) {
     case CONS_TAG:
+    case IMM_TAG:
+    case VEC_TAG:
+    case BUF_TAG:
     case PROC_TAG:
+    case PC_TAG:
       SANITY(
              if (ADDR_MASK(FST(a)) != 0)
                fprintf(logfilefd, "\"stack%llx\" -> \"%llx\" [color=\"red:magenta\"];\n",
@@ -327,7 +1044,7 @@ void collect() {
                        idx,
                        (ulong) ADDR_MASK(SND(a)));
              );
-      FST(a) = (ulong)copy(ADDR_MASK(FST(a))) | tag;
+      FST(a) = forward(FST(a));
       SND(a) = copy(SND(a));
       SANITY(
              if (ADDR_MASK(FST(a)) != 0)
@@ -343,35 +1060,47 @@ void collect() {
     }
   }
   SANITY(fprintf(logfilefd, "}\n"));
+  scan_c_roots(1);
 
   while (scan < HP) {
     ulong tag = TAG_MASK(FST(scan));
     switch (tag) {
     case CONS_TAG:
+    case IMM_TAG:
+    case VEC_TAG:
+    case BUF_TAG:
     case PROC_TAG:
+    case PC_TAG:
       SANITY(
        if (ADDR_MASK(FST(scan)) != 0)
          fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=\"red:magenta\"];\n",
-                 scan,
+                 (ulong)scan,
                  (ulong) ADDR_MASK(FST(scan)));
        if (ADDR_MASK(SND(scan)) != 0)
          fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=\"red:royalblue\"];\n",
-                 scan,
+                 (ulong)scan,
                  (ulong) ADDR_MASK(SND(scan)));
              );
-      FST(scan) = (ulong)copy(ADDR_MASK(FST(scan))) | tag;
+      FST(scan) = forward(FST(scan));
       SND(scan) = copy(SND(scan));
       SANITY(
        if (ADDR_MASK(FST(scan)) != 0)
          fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=\"black:magenta\"];\n",
-                 scan,
+                 (ulong)scan,
                  (ulong) ADDR_MASK(FST(scan)));
        if (ADDR_MASK(SND(scan)) != 0)
          fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=\"black:royalblue\"];\n",
-                 scan,
+                 (ulong)scan,
                  (ulong) ADDR_MASK(SND(scan)));
              );
       break;
+    case HDR_TAG:
+      SANITY(fprintf(logfilefd, "\"%llx\" -> \"%llx\" [color=\"red:magenta\"];\n",
+                     (ulong)scan,
+                     (ulong) SND(scan)));
+      scan_object(scan);
+      scan += 2*(HDR_CELLS(FST(scan)) - 1);
+      break;
     default:
       break;
     }
@@ -381,32 +1110,518 @@ void collect() {
          fwrite("}", 1, 1, logfilefd);
          fclose(logfilefd);
          );
+  /* the nursery was evacuated along with everything else */
+  YP = nursery;
+  ylimit = NURSERY_END;
+  remset_top = 0;
+  remset_overflow = 0;
+  ++stats.full_gcs;
+  stats.full_kept += (char*)HP - (char*)fromspace;
+  gc_pause(start);
+}
+
+#ifndef BAREMETAL
+void* map_region(ulong size) {
+  void* p = mmap(0, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) panic("mmap failed!\n");
+  return p;
+}
+
+char grow_heap() {
+  /* Doubles the semispaces, returning zero if that would take the heap
+     past HEAPMAX. Between collections tospace holds nothing, so it is
+     replaced by a bigger space, everything is collected into that, and
+     then the old fromspace is replaced too. */
+  ulong old = SEMIHEAPSIZE;
+  if (gc_compact) {
+    /* the whole of HEAPMAX is mapped from the start, and the mark
+       tables are big enough for it */
+    if (2*old > compact_semi(HEAPMAX)) return 0;
+    SEMIHEAPSIZE = 2*old;
+    ++stats.grows;
+    return 1;
+  }
+  if (NURSERYSIZE + 4*old > HEAPMAX) return 0;
+  munmap(tospace, old);
+  SEMIHEAPSIZE = 2*old;
+  tospace = map_region(SEMIHEAPSIZE);
+  collect();
+  munmap(tospace, old);
+  tospace = map_region(SEMIHEAPSIZE);
+  if (fwdtab) {
+    munmap(fwdtab, old/2);
+    fwdtab = map_region(SEMIHEAPSIZE/2);
+  }
+  ++stats.grows;
+  return 1;
+}
+#else
+char grow_heap() {return 0;}
+#endif
+
+void full_collect() {
+  /* A collection that gives the heap more room if too much of it
+     survived. When tospace couldn't take everything if it all
+     survived, the heap grows first, which collects into the bigger
+     space. */
+  if (gc_compact ||
+      ((char*)HP - (char*)fromspace) + ((char*)YP - (char*)nursery) <
+      SEMIHEAPSIZE ||
+      !grow_heap())
+    collect();
+  if ((char*)HP - (char*)fromspace > (SEMIHEAPSIZE / 100) * GROW_PERCENT)
+    grow_heap();
+}
+
+ulong scan_cell(ulong* c) {
+  /* Copies the children of the object at c, returning its length in
+     cells. */
+  switch (TAG_MASK(FST(c))) {
+  case CONS_TAG:
+  case IMM_TAG:
+  case VEC_TAG:
+  case BUF_TAG:
+  case PROC_TAG:
+  case PC_TAG:
+    FST(c) = forward(FST(c));
+    SND(c) = copy(SND(c));
+    return 1;
+  case HDR_TAG:
+    scan_object(c);
+    return HDR_CELLS(FST(c));
+  default:
+    return 1;
+  }
+}
+
+void scan_genv(char update) {
+  for (gbinding* b = (gbinding*)(M+GSTART); b < (gbinding*)(M+RSTART); ++b)
+    if (b->sym) SET_ROOT(b->val, copy(b->val));
+}
+
+void each_marked(ulong from, ulong to, ulong (*visit)(ulong*)) {
+  /* Calls visit on every marked object starting in words from to to of
+     the bitmap. Like scan_cell, visit returns the length of the object,
+     whose other cells are skipped. */
+  ulong skip = 0;
+  for (ulong w = from; w < to; ++w) {
+    for (ulong m = markbits[w]; m; m &= m - 1) {
+      if (skip) {
+        --skip;
+        continue;
+      }
+      skip = visit(marked_cell(64*w + LOW_BIT(m))) - 1;
+    }
+  }
+}
+
+void drain_marks() {
+  ulong* stack = (ulong*)(M+RSTART);
+  while (mark_top) scan_cell((ulong*)stack[--mark_top]);
+}
+
+ulong remark(ulong* c) {
+  ulong n = scan_cell(c);
+  drain_marks();
+  return n;
+}
+
+ulong* slide(ulong from, ulong to, ulong* dest) {
+  /* Moves the marked cells in words from to to of the bitmap down to
+     dest, in order, and clears the bitmap behind them. */
+  for (ulong w = from; w < to; ++w) {
+    for (ulong m = markbits[w]; m; m &= m - 1) {
+      ulong* c = marked_cell(64*w + LOW_BIT(m));
+      dest[0] = c[0];
+      dest[1] = c[1];
+      dest += 2;
+    }
+    markbits[w] = 0;
+  }
+  return dest;
+}
+
+void compact() {
+  /* The mark-compact full collection, which leaves the nursery empty
+     like the copying one. */
+  ulong start = now_ns();
+  stats.full_seen += ((char*)HP - (char*)fromspace) + ((char*)YP - (char*)nursery);
+  ulong young_end = ((YP - nursery)/2 + 63)/64;
+  ulong old_end = YOUNG_WORDS + ((HP - fromspace)/2 + 63)/64;
+
+  gc_compacting = COMPACT_MARK;
+  mark_top = 0;
+  mark_overflow = 0;
+  scan_roots(1);
+  scan_genv(1);
+  drain_marks();
+  while (mark_overflow) {
+    mark_overflow = 0;
+    each_marked(0, young_end, remark);
+    each_marked(YOUNG_WORDS, old_end, remark);
+  }
+
+  /* old cells keep their place in line, and the nursery's go after */
+  ulong live = 0;
+  for (ulong w = YOUNG_WORDS; w < old_end; ++w) {
+    markoffs[w] = live;
+    live += bit_count(markbits[w]);
+  }
+  for (ulong w = 0; w < young_end; ++w) {
+    markoffs[w] = live;
+    live += bit_count(markbits[w]);
+  }
+  while (2*live*sizeof(ulong) > SEMIHEAPSIZE)
+    if (!grow_heap()) panic("OOM!\n");
+
+  gc_compacting = COMPACT_UPDATE;
+  scan_roots(1);
+  scan_genv(1);
+  each_marked(0, young_end, scan_cell);
+  each_marked(YOUNG_WORDS, old_end, scan_cell);
+  gc_compacting = 0;
+
+  HP = slide(0, young_end, slide(YOUNG_WORDS, old_end, fromspace));
+  YP = nursery;
+  ylimit = NURSERY_END;
+  remset_top = 0;
+  remset_overflow = 0;
+  stats.copied += (char*)HP - (char*)fromspace;
+  ++stats.full_gcs;
+  stats.full_kept += (char*)HP - (char*)fromspace;
+  gc_pause(start);
+}
+
+void recopy_changed() {
+  /* Brings the copies of the old cells in the remembered set up to
+     date, once a minor collection has emptied the nursery, so that the
+     originals no longer point into it. A cell is either a whole object
+     or one slot of an environment or vector. */
+  ulong* remset = (ulong*)(M+RSTART);
+  gc_replica = 1;
+  for (ulong i = 0; i < remset_top; ++i) {
+    ulong* c = (ulong*)remset[i];
+    if ((remset[i] & 0x8) || c < fromspace || c >= HP) continue;
+    ulong* r = (ulong*)fwdtab[(c - fromspace)/2];
+    if (!r) continue;
+    ulong ncells = IS_CODE(c) ? HDR_CELLS(FST(c)) : 1;
+    for (ulong j = 0; j < 2*ncells; ++j) r[j] = c[j];
+    scan_cell(r);
+  }
+  gc_replica = 0;
+}
+
+ulong copy_some(ulong start) {
+  /* Scans copies until there are none left or the pause limit is up,
+     returning the cells of work done. The clock is only read every so
+     often, an object is scanned whole however big it is. */
+  ulong* from = tscan;
+  ulong* to = TP;
+  for (ulong n = 1; tscan < TP; ++n) {
+    tscan += 2*scan_cell(tscan);
+    /* leaving a little of the limit for whoever called */
+    if (!(n % 32) && now_ns() - start > gc_pause_limit - gc_pause_limit/4)
+      break;
+  }
+  return ((tscan - from) + (TP - to))/2;
+}
+
+ulong clear_some() {
+  /* Clears a stretch of fwdtab left over from the last cycle. */
+  ulong work = 0;
+  while (fwd_clear < fwd_dirty && work < GC_STEP_MIN * 64) {
+    fwdtab[fwd_clear++] = 0;
+    ++work;
+  }
+  if (fwd_clear == fwd_dirty) gc_phase = GC_IDLE;
+  return work;
+}
+
+ulong* next_step_limit(ulong work) {
+  ulong cells = work / GC_STEP_RATIO;
+  if (cells < GC_STEP_MIN) cells = GC_STEP_MIN;
+  if (YP + 2*cells >= NURSERY_END) return NURSERY_END;
+  return YP + 2*cells;
+}
+
+void start_cycle() {
+  gc_phase = GC_COPYING;
+  TP = tscan = tospace;
+  gc_replica = 1;
+  scan_roots(0);
+  scan_genv(0);
+  gc_replica = 0;
+}
+
+void flip() {
+  /* Ends a cycle at the end of a minor collection, with the copies up
+     to date: copies whatever is still missing, points the roots at the
+     copies and makes tospace the heap. */
+  gc_replica = 1;
+  scan_roots(1);
+  scan_genv(1);
+  while (tscan < TP) tscan += 2*scan_cell(tscan);
+  gc_replica = 0;
+  fwd_clear = 0;
+  fwd_dirty = (HP - fromspace)/2;
+  ulong* hold = fromspace;
+  fromspace = tospace;
+  tospace = hold;
+  HP = TP;
+  gc_phase = GC_CLEARING;
+  ++stats.incr_cycles;
+  if ((char*)HP - (char*)fromspace > (SEMIHEAPSIZE / 100) * GROW_PERCENT)
+    grow_heap();
+}
+
+void drop_cycle() {
+  /* Abandons a cycle for a full collection, which is about to do its
+     work anyway, and finishes clearing fwdtab. */
+  if (gc_phase == GC_COPYING) {
+    fwd_clear = 0;
+    fwd_dirty = (HP - fromspace)/2;
+  }
+  if (gc_phase != GC_IDLE)
+    for (ulong i = fwd_clear; i < fwd_dirty; ++i) fwdtab[i] = 0;
+  gc_phase = GC_IDLE;
+}
+
+void minor_collect();
+void gc_step() {
+  /* A bounded piece of the running cycle, taken when the allocator
+     reaches ylimit. The next step comes after allocating half as many
+     cells as this one worked on, which keeps the cycle ahead of the
+     program. Once nothing is left to copy, a minor collection does the
+     flip. */
+  ulong start = now_ns();
+  ulong work = 0;
+  if (gc_phase == GC_COPYING) {
+    if (tscan == TP) {
+      minor_collect();
+      return;
+    }
+    gc_replica = 1;
+    work = copy_some(start);
+    gc_replica = 0;
+  } else {
+    work = clear_some();
+  }
+  ylimit = gc_phase == GC_IDLE ? NURSERY_END : next_step_limit(work);
+  ++stats.incr_steps;
+  ulong t = gc_pause(start);
+  if (t > stats.step_pause_max) stats.step_pause_max = t;
+}
+
+void minor_collect() {
+  /* Promotes everything reachable in the nursery to the old
+     generation. The roots are the usual ones plus the remembered set,
+     so old objects are never traced. If the old generation might not
+     have room for the whole nursery, do a full collection instead. */
+  if (remset_overflow ||
+      ((char*)HP + ((char*)YP - (char*)nursery) >=
+       (char*)fromspace + SEMIHEAPSIZE)) {
+    full_collect();
+    return;
+  }
+  ulong start = now_ns();
+  stats.minor_seen += (char*)YP - (char*)nursery;
+  gc_minor = 1;
+  ulong* scan = HP;
+  ulong* promoted = HP;
+  scan_roots(1);
+  ulong* remset = (ulong*)(M+RSTART);
+  for (ulong i = 0; i < remset_top; ++i) {
+    if (remset[i] & 0x8) {
+      ulong** slot = (ulong**)remset[i];
+      *slot = copy(*slot);
+    } else {
+      scan_cell((ulong*)remset[i]);
+    }
+  }
+  while (scan < HP) scan += 2*scan_cell(scan);
+  stats.minor_kept += (char*)HP - (char*)promoted;
+  gc_minor = 0;
+  YP = nursery;
+  if (gc_phase == GC_COPYING) {
+    recopy_changed();
+    if (tscan == TP) {
+      flip();
+    } else {
+      /* new roots join the queue, and the cycle doesn't wait on the
+         allocator to get on with it */
+      gc_replica = 1;
+      scan_roots(0);
+      scan_genv(0);
+      copy_some(start);
+      gc_replica = 0;
+    }
+  } else if (gc_phase == GC_CLEARING) {
+    clear_some();
+  }
+  remset_top = 0;
+  if (gc_phase == GC_IDLE && gc_pause_limit &&
+      (char*)HP + GC_START_ROOM >=
+      (char*)fromspace + SEMIHEAPSIZE)
+    start_cycle();
+  ylimit = gc_phase == GC_IDLE ? NURSERY_END : next_step_limit(0);
+  ++stats.minor_gcs;
+  gc_pause(start);
 }
 
 /* forces the evalutation of the arguments to come after the call that
    can trigger GC */
 #define new_cons(a,b)                                                   \
   ({ulong* _hold = _new_cons(0,0); FST(_hold) = a, SND(_hold) = b, _hold;})
+/* A reference to the value (a, b) for a car, cdr or binding: an
+   immediate if it fits, otherwise a new cell. */
+#define box(a,b)                                                        \
+  ({ulong _imm = immediate(a, b); _imm ? (ulong*)_imm : new_cons(a, b);})
+/* With --gc-stress every allocation collects, minor or full, which
+   flushes out C code holding pointers it hasn't rooted. */
+#define GC_STRESS_MINOR 1
+#define GC_STRESS_FULL 2
+char gc_stress = 0;
+void make_room(ulong ncells) {
+  /* Called when an allocation of ncells would pass ylimit: a step if
+     that is what ylimit was waiting for, otherwise a collection. */
+  if (gc_stress == GC_STRESS_FULL) full_collect();
+  else if (!gc_stress && YP + 2*ncells < NURSERY_END) gc_step();
+  else minor_collect();
+}
+
 ulong* _new_cons(ulong a, ulong b) {
-  if (HP + 2 >= ((ulong)fromspace) + SEMIHEAPSIZE) {
-    collect();
+  if (gc_stress || YP + 2 >= ylimit) {
+    make_room(1);
   }
-  if (HP + 2 >= ((ulong)fromspace) + SEMIHEAPSIZE) {
+  if (YP + 2 >= NURSERY_END) {
     panic("OOM!\n");
   }
-  FST(HP) = a;
-  SND(HP) = b;
-  HP+=2;
-  return HP-2;
+  FST(YP) = a;
+  SND(YP) = b;
+  YP+=2;
+  ++stats.conses;
+  return YP-2;
 }
 
-char next_char = ' ';
+ulong* new_obj(ulong ncells, ulong kind) {
+  /* Allocates a zeroed multi-cell object with its header filled
+     in. Objects too big to sensibly put in the nursery go straight to
+     the old generation, and are remembered since they start young. */
+  ulong* obj;
+  if (ncells <= NURSERYSIZE/(8*sizeof(ulong))) {
+    if (gc_stress || YP + 2*ncells >= ylimit) {
+      make_room(ncells);
+    }
+    obj = YP;
+    YP += 2*ncells;
+  } else {
+    if (HP + 2*ncells >= (ulong*)((char*)fromspace + SEMIHEAPSIZE)) {
+      full_collect();
+    }
+    while (HP + 2*ncells >= (ulong*)((char*)fromspace + SEMIHEAPSIZE)) {
+      if (!grow_heap()) panic("OOM!\n");
+    }
+    obj = HP;
+    HP += 2*ncells;
+  }
+  for (ulong i = 0; i < 2*ncells; ++i) obj[i] = 0;
+  FST(obj) = HDR(ncells, kind);
+  ++stats.objs;
+  if (!IN_NURSERY(obj)) remember((ulong)obj);
+  return obj;
+}
+
+PER_INTERP char next_char = ' ';
+PER_INTERP char at_eof = 0;
+#ifndef BAREMETAL
+/* Source files are mapped and read straight out of memory. They nest:
+   a file is read to the end before going back to whatever was being
+   read when it was opened, and once every file is done the reader
+   falls back to stdin. Each source keeps the lookahead character of
+   the one below it. */
+#define MAX_SOURCES 32
+struct source {
+  char *base, *pos, *end;
+  char saved;
+  char done;
+};
+PER_INTERP struct source sources[MAX_SOURCES];
+PER_INTERP ulong source_top = 0;
+char* source_args[MAX_SOURCES];
+ulong n_source_args = 0;
+#endif
 char read_char() {
   char hold = next_char;
+#ifndef BAREMETAL
+  if (source_top) {
+    struct source* s = &sources[source_top-1];
+    if (s->pos < s->end) {
+      next_char = *s->pos++;
+    } else if (!s->done) {
+      /* the end of a file ends a token too */
+      next_char = '\n';
+      s->done = 1;
+    } else {
+      next_char = s->saved;
+      munmap(s->base, s->end - s->base);
+      --source_top;
+    }
+    return hold;
+  }
+  if (batch_jobs) {
+    /* a batch job has no stdin to fall back to */
+    at_eof = 1;
+    next_char = EOF;
+    return hold;
+  }
+  int c = getchar();
+  if (c == EOF) at_eof = 1;
+  next_char = c;
+#else
   next_char = getchar();
+#endif
   return hold;
 }
 
+#ifndef BAREMETAL
+char* map_file(char* path, ulong* len) {
+  /* Maps the file at path read only, returning NULL if it is empty. */
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    print_err(path);
+    panic(": can't open file!\n");
+  }
+  *len = st.st_size;
+  if (!st.st_size) {
+    close(fd);
+    return 0;
+  }
+  char* base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    print_err(path);
+    panic(": can't map file!\n");
+  }
+  return base;
+}
+
+void open_source(char* path) {
+  /* Points the reader at the contents of the file at path. */
+  ASSERT(source_top < MAX_SOURCES, "Too many nested loads!");
+  ulong len;
+  char* base = map_file(path, &len);
+  if (!base) return;
+  struct source* s = &sources[source_top++];
+  s->base = s->pos = base;
+  s->end = base + len;
+  s->saved = next_char;
+  s->done = 0;
+  read_char();                  /* the old lookahead is in saved */
+}
+#endif
+
 char streq(ulong* len, char* a, char* b) {
   /* Returns non-zero if a and b point to matching strings, or zero
      otherwise. Places the length of a including null terminator in
@@ -430,12 +1645,20 @@ char streq(ulong* len, char* a, char* b) {
 #endif
     }
 
+void strcpy_inc(char** dest, char* src) {
+  while (*((*dest)++) = *src++) {}
+}
+
 char* read_token() {
-  char* td = DP;
+  /* Reads the next token into the free space at DP, after room for its
+     flags, without committing it to the dictionary. The returned string
+     is only valid until the next read_token or intern call. */
+  char* td = DP + 1;
   char c;
   for (
        *(td++) = c = read_char();
-       (next_char != ' ' &&
+       (!at_eof &&
+        next_char != ' ' &&
         next_char != '\n' &&
         next_char != ')') &&
          !(c == '\'' ||
@@ -445,23 +1668,74 @@ char* read_token() {
            c == '(' ||
            c == ')');
        *(td++) = c = read_char()
-       ) {}
+       ) {
+    ASSERT(td < M+DEND-1, "Dictionary full!");
+  }
   *(td++) = 0;
-  char* indict = M+DSTART;
-  char* newsym = DP;
+  return DP + 1;
+}
+
+/* The symbol table is an open addressed hash table of pointers into
+   the dictionary. It sits directly below the dictionary in M and is
+   the only way a string makes it into the dictionary, so two symbols
+   are the same symbol iff they are the same pointer. Each string in the
+   dictionary comes after a byte of flags for the symbol. */
+#define SYM_FLAGS(sym) (((unsigned char*)(sym))[-1])
+/* set once pope has bound the symbol anywhere but the top level, which
+   it never unsets. Until then the symbol can only be in the global
+   environment, and looking it up can skip the environment frames. */
+#define SYM_LOCAL 1
+#define IS_LOCAL_SYM(sym) (SYM_FLAGS(sym) & SYM_LOCAL)
+PER_INTERP ulong symcount = 0;
+ulong hash_str(char* str) {
+  /* FNV-1a */
+  ulong h = 0xcbf29ce484222325ULL;
+  while (*str) {
+    h ^= (unsigned char)*str++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+char* intern(char* str) {
+  /* Returns the dictionary copy of str, adding it if it isn't there
+     yet. str may be the uncommitted token from read_token. */
+  char** symtab = (char**)(M+TSTART);
+  ulong i = hash_str(str) & (SYMTAB_ENTRIES - 1);
   ulong len;
-  while (!streq(&len, indict, newsym)) {
-    indict += len;
-    while (*indict++) {}
+  while (symtab[i]) {
+    if (streq(&len, symtab[i], str)) return symtab[i];
+    i = (i + 1) & (SYMTAB_ENTRIES - 1);
   }
-  if (indict == newsym) {// only match is the new sym
-    DP = td;
-    return newsym;
-  } else {                      // exiting match
-    return indict;
+  ASSERT(symcount < SYMTAB_ENTRIES - (SYMTAB_ENTRIES / 4), "Symbol table full!");
+  streq(&len, str, str);
+  ASSERT(DP + 1 + len < M+DEND, "Dictionary full!");
+  *DP++ = 0;
+  char* newsym = DP;
+  if (str == DP) {
+    while (*DP++) {}
+  } else {
+    strcpy_inc(&DP, str);
   }
+  symtab[i] = newsym;
+  ++symcount;
+  return newsym;
 }
 
+/* The global environment is a second open addressed table, this one
+   keyed on the symbol pointer itself, holding the value cell of every
+   top level binding. Lexical environments are chains of frames that
+   end in root_env, and falling off the end of one means looking here.
+   It is as large as the symbol table, so it can never fill up. */
+#define GENV_HASH(sym)                                                  \
+  ((((ulong)(sym) * 0x9e3779b97f4a7c15ULL) >> 32) & (SYMTAB_ENTRIES - 1))
+gbinding* genv_find(char* sym) {
+  /* Returns the binding for sym, or the empty slot it would go in. */
+  gbinding* genv = (gbinding*)(M+GSTART);
+  ulong i = GENV_HASH(sym);
+  while (genv[i].sym && genv[i].sym != sym) i = (i + 1) & (SYMTAB_ENTRIES - 1);
+  return &genv[i];
+}
 void slurp_whitespace() {
   while (next_char == ' ' ||
          next_char == '\t' ||
@@ -472,42 +1746,50 @@ struct as_int_t {char b; ulong v;};
 struct as_int_t as_int(char* str) {
   ulong val = 0;
   char neg = (*str == '-') ? ++str, -1 : 1;
+  if (!*str) return ((struct as_int_t) {0, 0});
   for (char c = *str; c != 0; c = *(++str)) {
     if (c < '0' || c > '9') return ((struct as_int_t) {0, 0});
     val = (val*10) + (c - '0');
   }
   val *= neg;
-  while (*(--DP) == 0) {}       // remove the last dictionary entry
-  while (*(--DP) != 0) {}
-  DP++;
   return ((struct as_int_t) {1, val});
 }
 
 // syntax special forms
-char* SQUOTE_SYM;
-char* SPUSH_SYM;
-char* SPOP_SET_SYM;
-char* SPOP_EXT_SYM;
-
-char* QUOTE_SYM;
-char* PUSH_SYM;
-char* POP_SET_SYM;
-char* POP_EXT_SYM;
-char* PUSHR_SYM;
-char* OPAREN_SYM;
-char* CPAREN_SYM;
-char* T_SYM;
-char* READ_SYM;
-char* READ_FLUSH_SYM;
-char* PRINT_SYM;
-char* OR_SYM;
-char* CONS_SYM;
+PER_INTERP char* SQUOTE_SYM;
+PER_INTERP char* SPUSH_SYM;
+PER_INTERP char* SPOP_SET_SYM;
+PER_INTERP char* SPOP_EXT_SYM;
+
+PER_INTERP char* QUOTE_SYM;
+PER_INTERP char* PUSH_SYM;
+PER_INTERP char* POP_SET_SYM;
+PER_INTERP char* POP_EXT_SYM;
+PER_INTERP char* PUSHR_SYM;
+PER_INTERP char* OPAREN_SYM;
+PER_INTERP char* CPAREN_SYM;
+PER_INTERP char* T_SYM;
+PER_INTERP char* READ_SYM;
+PER_INTERP char* READ_FLUSH_SYM;
+PER_INTERP char* PRINT_SYM;
+PER_INTERP char* OR_SYM;
+PER_INTERP char* CONS_SYM;
 
 void p_push (void);
 void p_pushr (void);
 void p_pops (void);
 void p_pope (void);
-cell read_stack = {NIL_TAG,0};
+void p_popr (void);
+void p_eq (void);
+void p_car (void);
+void p_cdr (void);
+void p_cswap (void);
+void p_dup (void);
+void p_drop (void);
+void p_add (void);
+void p_sub (void);
+void p_mul (void);
+PER_INTERP cell read_stack = {NIL_TAG,0};
 /* DO NOT TOUCH */
 #define STARTREADSTACK()                        \
   {                                             \
@@ -516,14 +1798,15 @@ cell read_stack = {NIL_TAG,0};
 
 #define PUSHREADSTACK(contents)                                 \
   {                                                             \
-    *(SP-1) = new_cons(*SP, *(SP+1));                           \
-    *(SP-2) = CONS_TAG;                                         \
-    SP-=2;                                                      \
     cell _h = contents;                                         \
-    FST(SP) = (ulong)new_cons(_h.car, _h.cdr) | CONS_TAG;       \
-    *(SP+2) = *SP;                                              \
-    *(SP+3) = *(SP+1);                                          \
-    SP+=2;                                                      \
+    ROOTS_BEGIN;                                                \
+    ROOT_CELL(_h);                                              \
+    ulong* _item = new_cons(_h.car, _h.cdr);                    \
+    ROOT_WORD(_item);                                           \
+    ulong* _rest = new_cons(SP[0], SP[1]);                      \
+    ROOTS_END;                                                  \
+    SP[0] = (ulong)_item | CONS_TAG;                            \
+    SP[1] = _rest;                                              \
   }
 
 #define SAVEREADSTACK()                         \
@@ -533,7 +1816,8 @@ cell read_stack = {NIL_TAG,0};
     SP+=2;                                      \
   }
 
-SANITY(ulong read_depth = 0;)
+void finish(void);
+SANITY(PER_INTERP ulong read_depth = 0;)
 cell read() {
   SANITY(++read_depth; ulong* entry_SP = SP;)
     cell ret;
@@ -546,40 +1830,38 @@ cell read() {
     ret = ret;
   } else {
     slurp_whitespace();
-    char* raw_sym = read_token();
-    if (raw_sym == SQUOTE_SYM) {
-      cell out = {SYM_TAG, QUOTE_SYM};
-      ret = out;
-    } else if (raw_sym == SQUOTE_SYM) {
-      STARTREADSTACK();
-      PUSHREADSTACK(read());
-      SAVEREADSTACK();
-      cell out = {SYM_TAG, QUOTE_SYM};
-      ret = out;
-    } else if (raw_sym == SPUSH_SYM) {
-      STARTREADSTACK();
-      cell rs = {SYM_TAG, PUSH_SYM};
-      PUSHREADSTACK(rs);
-      PUSHREADSTACK(read());
-      SAVEREADSTACK();
-      cell out = {SYM_TAG, QUOTE_SYM};
-      ret = out;
-    } else if (raw_sym == SPOP_SET_SYM) {
-      STARTREADSTACK();
-      cell rs = {SYM_TAG, POP_SET_SYM};
-      PUSHREADSTACK(rs);
-      PUSHREADSTACK(read());
-      SAVEREADSTACK();
-      cell out = {SYM_TAG, QUOTE_SYM};
-      ret = out;
-    } else if (raw_sym == SPOP_EXT_SYM) {
-      STARTREADSTACK();
-      cell rs = {SYM_TAG, POP_EXT_SYM};
-      PUSHREADSTACK(rs);
-      PUSHREADSTACK(read());
-      SAVEREADSTACK();
-      cell out = {SYM_TAG, QUOTE_SYM};
+    if (at_eof) finish();
+    char* token = read_token();
+    struct as_int_t maybe_int = as_int(token);
+    char* raw_sym = (maybe_int.b) ? 0 : intern(token);
+    if (maybe_int.b) {          // C struct return type moment :( ugly
+      cell out = {INT_TAG, maybe_int.v};
       ret = out;
+    } else if (raw_sym == SQUOTE_SYM || raw_sym == SPUSH_SYM ||
+               raw_sym == SPOP_SET_SYM || raw_sym == SPOP_EXT_SYM) {
+      ulong kind = (raw_sym == SQUOTE_SYM) ? SIGIL_QUOTE
+        : (raw_sym == SPUSH_SYM) ? SIGIL_PUSH
+        : (raw_sym == SPOP_SET_SYM) ? SIGIL_POPS : SIGIL_POPE;
+      cell next = read();
+      if (next.car == SYM_TAG) {
+        cell out = {SIGIL(kind), next.cdr};
+        ret = out;
+      } else {
+        /* quote, then what was read, then the primitive */
+        char* prims[] = {0, PUSH_SYM, POP_SET_SYM, POP_EXT_SYM};
+        ROOTS_BEGIN;
+        ROOT_CELL(next);
+        STARTREADSTACK();
+        if (kind != SIGIL_QUOTE) {
+          cell rs = {SYM_TAG, prims[kind]};
+          PUSHREADSTACK(rs);
+        }
+        PUSHREADSTACK(next);
+        SAVEREADSTACK();
+        ROOTS_END;
+        cell out = {SYM_TAG, QUOTE_SYM};
+        ret = out;
+      }
     } else if (raw_sym == OPAREN_SYM) {
       /* This is weird but forces the allocation to happen in order,
          interleaved with placing the location on the stack so it is
@@ -591,12 +1873,9 @@ cell read() {
         SP-=2;
         *SP = ret.car;
         *(SP+1) = ret.cdr;
-        ulong* h = new_cons(0, 0);
-        FST(h) = *SP | CONS_TAG;
-        SND(h) = *(SP+1);
-        *(SP+1) = 0;
+        ulong* h = box(*SP, *(SP+1));
+        *(SP+1) = IMM(IMM_NIL, 0);
         *SP = h;
-        *(SP+1) = new_cons(NIL_TAG, 0);
         ret = read();
       }
       // The list is read into the stack, now collect it up
@@ -611,190 +1890,756 @@ cell read() {
       cell out = {NIL_TAG, 0};
       ret = out;
     } else {
-      char* cstr = raw_sym;
-      struct as_int_t maybe_int = as_int(cstr);
-      if (maybe_int.b) {        // C struct return type moment :( ugly
-        cell out = {INT_TAG, maybe_int.v};
-        ret = out;
-      } else {
-        cell out = {SYM_TAG, raw_sym};
-        ret = out;
-      }
+      cell out = {SYM_TAG, raw_sym};
+      ret = out;
     }
   }
   SANITY(--read_depth; if (!read_depth) ASSERT(SP == entry_SP, "Non recursive read altered SP");)
     return ret;
 }
 
-ulong print_depth = 0;
+PER_INTERP ulong print_depth = 0;
 void print(ulong*, char);
+void print_ref(ulong* r) {
+  cell c = deref(r);
+  print((ulong*)&c, 0);
+}
 void print_list(ulong* l) {
   if (!l) panic("NULL head in print_list");
-  while ((TAG_MASK(FST(l)) != NIL_TAG) && (TAG_MASK(FST(l)) == CONS_TAG)) {
-    print(FST(l), 0);
-    if (FST(SND(l)) != NIL_TAG) putchar(' ');
+  while (IS_PAIR(l)) {
+    print_ref(FST(l));
+    if (deref(SND(l)).car != NIL_TAG) out_char(' ');
     l = SND(l);
   }
 }
-#define pow(a,b) {typeof(a) _val=1; typeof(b) _b = b; while(_b--) _val*=a; _val;}
+char digit_pairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233"
+  "34353637383940414243444546474849505152535455565758596061626364656667"
+  "6869707172737475767778798081828384858687888990919293949596979899";
 void print_int(ulong val) {
-  if ((long long) val < 0) putchar('-');
-  val &= ~(1ULL << 63);
-  for (int s = 19; s >= 0; --s) {
-    int c = (val / (pow(10, s))) % 10;
-    putchar((char)(c + '0'));
+  /* Signed decimal, written from the back two digits at a time out of
+     a table. Dividing by a constant 100 compiles to a multiply. */
+  char buf[20];
+  char* d = buf + sizeof(buf);
+  ulong mag = ((long long)val < 0) ? -val : val;
+  while (mag >= 100) {
+    ulong r = mag % 100;
+    mag /= 100;
+    d -= 2;
+    d[0] = digit_pairs[2*r];
+    d[1] = digit_pairs[2*r+1];
+  }
+  if (mag >= 10) {
+    d -= 2;
+    d[0] = digit_pairs[2*mag];
+    d[1] = digit_pairs[2*mag+1];
+  } else {
+    *(--d) = '0' + mag;
   }
+  if ((long long)val < 0) *(--d) = '-';
+  out_bytes(d, buf + sizeof(buf) - d);
 }
 void print(ulong* v, char newline) {
   if (print_depth >= MAX_PRINT_DEPTH) {
-    putstring("...");
+    out_string("...");
     return;
   }
   ++print_depth;
-  switch (TAG_MASK(FST(v))) {
+  switch (VAL_TAG(FST(v))) {
   case NIL_TAG:
-    putstring("nil");
+    out_string("nil");
     break;
   case CONS_TAG:
-    if (TAG_MASK(FST(SND(v))) != CONS_TAG) {
-      putchar('(');
-      print(FST(v), 0);
-      putstring(" . ");
-      print(SND(v), 0);
-      putchar(')');
+    if (!IS_PAIR(SND(v))) {
+      out_char('(');
+      print_ref(FST(v));
+      out_string(" . ");
+      print_ref(SND(v));
+      out_char(')');
     } else {
-      putchar('(');
+      out_char('(');
       print_list(v);
-      putchar(')');
+      out_char(')');
     }
     break;
   case SYM_TAG:
-    putstring((char*)SND(v));
+    out_string((char*)SND(v));
+    break;
+  case SIGIL_TAG:
+    out_char(SIGIL_CHARS[SIGIL_KIND(FST(v))]);
+    out_string((char*)SND(v));
     break;
   case INT_TAG:
     print_int((ulong)SND(v));
     break;
   case PROC_TAG:
-    putchar('[');
-    print_list(FST(v));
-    putchar(']');
+    out_char('[');
+    print_list(PROC_SRC(v));
+    out_char(']');
     break;
   case PRIM_TAG:
-    putstring("PRIM");
+    out_string("PRIM");
+    break;
+  case VEC_TAG:
+    out_string("#(");
+    for (ulong i = 0; i < VEC_LEN(SND(v)); ++i) {
+      if (i) out_char(' ');
+      print(VEC_REF((ulong*)SND(v), i), 0);
+    }
+    out_char(')');
+    break;
+  case BUF_TAG:
+    out_string("#u8(");
+    for (ulong i = 0; i < BUF_LEN(SND(v)); ++i) {
+      if (i) out_char(' ');
+      print_int(BUF_DATA((ulong*)SND(v))[i]);
+    }
+    out_char(')');
     break;
   default:
     panic("Unknown tag in print!");
   }
-  if (newline) putchar('\n');
+  if (newline) out_char('\n');
   --print_depth;
 }
 
-ulong* lookup(ulong* env, char* raw_sym) {
+ulong* global_value(gbinding* b) {
+  /* The value of a global binding, which like find_value's is only good
+     until the next allocation. */
+  if (!IS_IMM(b->val)) return b->val;
+  /* an immediate gets a cell good until the next lookup, aligned like
+     any other since FST and SND mask the address */
+  static PER_INTERP cell imm_value __attribute__((aligned(16)));
+  imm_value = deref(b->val);
+  return (ulong*)&imm_value;
+}
+ulong* find_value(ulong* env, char* raw_sym) {
+  /* Like lookup, but returns NULL for an unbound symbol. The value may
+     be a slot inside an environment frame, so it is only good until
+     the next allocation and must not be used as a cell of its own. */
   if (!env) panic("NULL env in lookup!");
-  while (TAG_MASK(FST(env)) == CONS_TAG) {
-    ulong* pair = FST(env);
-    ulong* cursym = FST(pair);
-    ulong _len;
-    if (streq(&_len, (char*)SND(cursym), raw_sym)) {
-      return SND(pair);
+  if (IS_LOCAL_SYM(raw_sym)) {
+    while (IS_ENV(env)) {
+      char** syms = ENV_SYMS(env);
+      for (ulong i = ENV_USED(env); i-- > 0;) {
+        if (syms[i] == raw_sym) return ENV_VAL(env, i);
+      }
+      env = SND(env);
     }
-    env = SND(env);
+    if (TAG_MASK(FST(env)) != NIL_TAG) panic("Malformed env in lookup!");
   }
-  if (TAG_MASK(FST(env)) != NIL_TAG) panic("Malformed env in lookup!");
+  gbinding* b = genv_find(raw_sym);
+  if (!b->sym) return 0;
+  return global_value(b);
+}
+ulong* lookup(ulong* env, char* raw_sym) {
+  ulong* val = find_value(env, raw_sym);
+  if (val) return val;
   print_err((char*)raw_sym);
   panic(": undefined symbol (lookup)!");
 }
 
 
-void eval() {
- eval_outer:
-  while (TAG_MASK(return_stack.car) != NIL_TAG) {
-    SANITY(
-           ASSERT(TAG_MASK(return_stack.car) == CONS_TAG,
-                  "Malformed return stack in eval!");
-           ASSERT(TAG_MASK(FST(PROC)) == PROC_TAG,
-                  "Non proc on return stack!");
-           );
-    if (TAG_MASK(FST(BODY)) == NIL_TAG) {
-      // exhausted the body of the procedure, pop from ret stack
-      --depth;
-      if (depth == 0) root_env = *ENV;
-      return_stack.car = FST(return_stack.cdr);
-      return_stack.cdr = SND(return_stack.cdr);
-      if (depth == 0) return;
-      else {
-        INC_PC;
-        continue;
-      }
-    }
-    ASSERT(SP-2 > DP, "Stack overflow!");
-    SANITY(ASSERT(CUR, "NULL in eval!"));
+/* Compilation turns a body list into a code object. Like read, it is
+   recursive (once per level of nesting) and keeps everything it is
+   working on on the stack, since it allocates. */
+#define IS_QUOTE(item) ((item).car == SYM_TAG && (char*)(item).cdr == QUOTE_SYM)
+
+/* The pairs that are fused are the ones that each made up more than 3%
+   of the ops dispatched over bench/ in a -DOP_PAIRS build with no
+   pairs fused, 30.8M in all. By millions, counting OP_GSYM as OP_SYM:
+
+     sym sym      5.4   spush int      1.7   spope sym      0.9
+     sym spope    3.1   spope closure  1.6   closure closure 0.9
+     spush sym    2.9   spush spush    1.2   closure sym    0.9
+     sym spush    2.5                        closure spush  0.9
+     int sym      2.2
+     spope spope  1.9
+
+   Compilation comes before any symbol op becomes OP_GSYM, so only
+   OP_SYM needs looking for here. */
+ulong fused_op(ulong first, ulong second) {
+  /* The superinstruction for first when second comes after it, or 0 if
+     the pair isn't one to fuse. */
+  switch (first) {
+  case OP_INT:
+    return (second == OP_SYM) ? OP_INT_NEXT : 0;
+  case OP_SYM:
+    return (second == OP_SYM || second == OP_SPOPE ||
+            second == OP_SPUSH) ? OP_SYM_NEXT : 0;
+  case OP_SPUSH:
+    return (second == OP_SYM || second == OP_INT ||
+            second == OP_SPUSH) ? OP_SPUSH_NEXT : 0;
+  case OP_SPOPE:
+    return (second == OP_SPOPE || second == OP_CLOSURE ||
+            second == OP_SYM) ? OP_SPOPE_NEXT : 0;
+  case OP_CLOSURE:
+    return (second == OP_CLOSURE || second == OP_SYM ||
+            second == OP_SPUSH) ? OP_CLOSURE_NEXT : 0;
+  }
+  return 0;
+}
 
-    switch (TAG_MASK(FST(CUR))) {
+void compile_body(void) {
+  /* Replaces the body list on the top of the stack with its code. */
+  ulong nops = 0, nbinds = 0;
+  for (ulong* l = SP[0]; IS_PAIR(l); l = SND(l)) {
+    ++nops;
+    if (deref(FST(l)).car == SIGIL(SIGIL_POPE)) ++nbinds;
+    if (IS_QUOTE(deref(FST(l))) && IS_PAIR(SND(l))) {
+      l = SND(l);
+      ulong* next = SND(l);
+      if (deref(FST(l)).car == SYM_TAG &&
+          IS_PAIR(next) &&
+          deref(FST(next)).car == SYM_TAG &&
+          (char*)deref(FST(next)).cdr == POP_EXT_SYM)
+        ++nbinds;
+    }
+  }
+  ASSERT(nops + 2 <= 0xffffff, "Body too long!");
+  // ^ see OP_IDX
+  ulong* code = new_obj(nops + 2, CODE_KIND);
+  SND(code) = SP[0];
+  WRITE_BARRIER(code);
+  PUSH((ulong)code | CONS_TAG, 0);
+  /* SP[0] is the code, SP[2] the remainder of the list */
+  for (ulong idx = 1; IS_PAIR(SP[2]); ++idx) {
+    cell item = deref(FST(SP[2]));
+    ulong op, arg = 0;
+    switch (VAL_TAG(item.car)) {
     case NIL_TAG:
-    case INT_TAG:
-      PUSH(FST(CUR), SND(CUR));
+      op = OP_NIL;
       break;
-    case CONS_TAG:
-      PUSH((ulong)CUR | PROC_TAG, (ulong)(*ENV));
+    case INT_TAG:
+      op = OP_INT;
+      arg = item.cdr;
       break;
     case SYM_TAG:
-      if (SND(CUR) == QUOTE_SYM) {
-        INC_PC;
-        ASSERT(TAG_MASK(FST(BODY)) != NIL_TAG,
-               "No data followed a quote in eval!");
-        PUSH(FST(CUR), SND(CUR));
+      if (!IS_QUOTE(item)) {
+        op = OP_SYM;
+        arg = item.cdr;
+      } else if (!IS_PAIR(SND(SP[2]))) {
+        op = OP_BADQUOTE;
       } else {
-        /* act on interal value */
-        ulong* val = lookup(*ENV, SND(CUR));
-        switch (TAG_MASK(FST(val))) {
-        case NIL_TAG:
-        case INT_TAG:
-          PUSH(FST(val), SND(val));
-          break;
-        case CONS_TAG:
-          PUSH((ulong)val | PROC_TAG, (ulong)(*ENV));
-          break;
-        case SYM_TAG:
-          /* act as if quoted */
-          PUSH(FST(val), SND(val));
-          break;
-        case PROC_TAG:
-          INSTALL(val);
-          goto eval_outer;
-        case PRIM_TAG:
-          if (((stack_func)(SND(val))) == p_pushr) {
-            /* INC_PC happens internally */
-            ((stack_func)(SND(val)))();
-            goto eval_outer;
-          } else {
-            ((stack_func)(SND(val)))();
-            break;
-          }
-        default:
-          panic("Unknown tag in eval while executing symbol!");
-        }
+        SP[2] = SND(SP[2]);
+        item = deref(FST(SP[2]));
+        if (item.car == SYM_TAG) op = OP_QSYM;
+        else if (item.car == INT_TAG) op = OP_INT;
+        else if (item.car == NIL_TAG) op = OP_NIL;
+        else op = OP_QUOTE;
+        arg = (op == OP_QUOTE) ? FST(SP[2]) : item.cdr;
       }
       break;
-    case PROC_TAG:
+    case CONS_TAG:
       {
-        INSTALL(CUR);
-        continue;
+        ulong sub = FST(SP[2]);
+        PUSH(sub, 0);
       }
-    case PRIM_TAG:
-      if (((stack_func)(SND(CUR))) == p_pushr) {
-        /* INC_PC happens internally */
-        ((stack_func)(SND(CUR)))();
-        goto eval_outer;
-      } else {
-        ((stack_func)(SND(CUR)))();
-        break;
+      compile_body();
+      op = OP_CLOSURE;
+      arg = SP[0];
+      SP+=2;
+      break;
+    case SIGIL_TAG:
+      {
+        ulong sigil_ops[] = {OP_QSYM, OP_SPUSH, OP_SPOPS, OP_SPOPE};
+        op = sigil_ops[SIGIL_KIND(item.car)];
+        arg = item.cdr;
       }
+      break;
+    case PROC_TAG:
+    case PRIM_TAG:
+      op = OP_CELL;
+      arg = FST(SP[2]);
+      break;
+    case VEC_TAG:
+    case BUF_TAG:
+      op = OP_QUOTE;
+      arg = FST(SP[2]);
+      break;
     default:
-      panic("Unknown tag in eval!");
+      panic("Unknown tag in compile!");
     }
-    // move the body pointer of the current procedure forward
+    code = ADDR_MASK(SP[0]);
+    FST(code + 2*idx) = OP_WORD(idx, op);
+    SND(code + 2*idx) = arg;
+    WRITE_BARRIER(code);
+    SP[2] = SND(SP[2]);
+  }
+  code = ADDR_MASK(SP[0]);
+  FST(code + 2*(nops+1)) = OP_WORD(nops+1, OP_RET);
+  SND(code + 2*(nops+1)) = nbinds;
+  for (ulong idx = 1; idx < nops; ++idx) {
+    /* a pass for superinstructions, looking at the op after each */
+    ulong* op = code + 2*idx;
+    ulong fused = fused_op(OP_OF(FST(op)), OP_OF(FST(op+2)));
+    if (fused) FST(op) = OP_WORD(idx, fused);
+  }
+  SP[2] = SP[0];
+  SP[3] = 0;
+  SP+=2;
+}
+
+void to_frame(void) {
+  /* Turns the proc on the top of the stack into the contents of a
+     frame, compiling its body the first time through. */
+  SANITY(ASSERT(TAG_MASK(SP[0]) == PROC_TAG, "non-proc in to_frame"));
+  if (!IS_CODE(ADDR_MASK(SP[0]))) {
+    ulong body = (ulong)ADDR_MASK(SP[0]);
+    PUSH(body | CONS_TAG, 0);
+    compile_body();
+    SP[2] = SP[0] | PROC_TAG;
+    SP+=2;
+  }
+  SP[0] = (ulong)(ADDR_MASK(SP[0]) + 2) | PC_TAG;
+}
+
+#ifndef BAREMETAL
+/* The sampling profiler. SIGPROF only sets a flag, and eval takes the
+   sample at the top of its loop, where the heap is in a consistent
+   state. A sample is one line of folded stacks: the names of the
+   frames on the return stack from the top level down, separated by
+   semicolons, and then a count of 1, which flamegraph tools add
+   up. */
+#define PROFILE_USEC 1000
+#define PROFILE_MAX_FRAMES 256
+#define PROFILE_NAME_CELLS 3
+FILE* profile_out = 0;
+volatile sig_atomic_t profile_pending = 0;
+void on_sigprof(int sig) {profile_pending = 1;}
+
+void start_profile(char* path) {
+  profile_out = fopen(path, "w");
+  if (!profile_out) {
+    print_err(path);
+    panic(": can't open profile output!\n");
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sigprof;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, 0);
+  struct itimerval t = {{0, PROFILE_USEC}, {0, PROFILE_USEC}};
+  setitimer(ITIMER_PROF, &t, 0);
+}
+
+#define FRAME_CODE(frame)                                               \
+  (ADDR_MASK(FST(frame)) - 2*OP_IDX(FST(ADDR_MASK(FST(frame)))))
+
+void profile_str(char* str) {
+  /* semicolons separate frames */
+  for (; *str; ++str) fputc((*str == ';') ? '_' : *str, profile_out);
+}
+
+void profile_cells(ulong* l) {
+  /* Names a proc by the start of its body. */
+  fputc('[', profile_out);
+  for (ulong i = 0;
+       IS_PAIR(l);
+       ++i, l = SND(l)) {
+    if (i) fputc(' ', profile_out);
+    if (i == PROFILE_NAME_CELLS) {
+      fputs("...", profile_out);
+      break;
+    }
+    cell item = deref(FST(l));
+    switch (VAL_TAG(item.car)) {
+    case SYM_TAG:
+      profile_str((char*)item.cdr);
+      break;
+    case SIGIL_TAG:
+      fputc(SIGIL_CHARS[SIGIL_KIND(item.car)], profile_out);
+      profile_str((char*)item.cdr);
+      break;
+    case INT_TAG:
+      fprintf(profile_out, "%lld", (long long)item.cdr);
+      break;
+    case NIL_TAG:
+      fputs("nil", profile_out);
+      break;
+    default:
+      fputs("(..)", profile_out);
+    }
+  }
+  fputc(']', profile_out);
+}
+
+void take_sample() {
+  /* Each frame is named after the global bound to its proc, failing
+     that the symbol its caller called it through, and failing that the
+     start of its body. Finding globals means a pass over genv, with
+     the code objects of this sample in a little hash table. */
+  profile_pending = 0;
+  ulong* frames[PROFILE_MAX_FRAMES];
+  ulong n = 0;
+  ulong* f = FP;
+  while (f > FRAME_BASE && n < PROFILE_MAX_FRAMES) {
+    frames[n++] = f;
+    f -= 2;
+  }
+  char truncated = f > FRAME_BASE;
+
+  struct {ulong* code; char* name;} table[2*PROFILE_MAX_FRAMES];
+  memset(table, 0, sizeof(table));
+#define PROFILE_SLOT(c)                                                 \
+  ({ulong _i = ((ulong)(c) >> 4) % (2*PROFILE_MAX_FRAMES);              \
+    while (table[_i].code && table[_i].code != (c))                     \
+      _i = (_i + 1) % (2*PROFILE_MAX_FRAMES);                           \
+    _i;})
+  for (ulong i = 0; i < n; ++i) {
+    ulong* code = FRAME_CODE(frames[i]);
+    table[PROFILE_SLOT(code)].code = code;
+  }
+  gbinding* genv = (gbinding*)(M+GSTART);
+  for (ulong i = 0; i < SYMTAB_ENTRIES; ++i) {
+    if (!genv[i].sym || IS_IMM(genv[i].val) ||
+        TAG_MASK(FST(genv[i].val)) != PROC_TAG) continue;
+    ulong* code = ADDR_MASK(FST(genv[i].val));
+    ulong slot = PROFILE_SLOT(code);
+    if (table[slot].code && !table[slot].name) table[slot].name = genv[i].sym;
+  }
+
+  if (truncated) fputs("...;", profile_out);
+  for (ulong i = n; i-- > 0;) {
+    ulong* code = FRAME_CODE(frames[i]);
+    char* name = table[PROFILE_SLOT(code)].name;
+    if (!name && i+1 < n) {
+      ulong* caller = ADDR_MASK(FST(frames[i+1]));
+      ulong* val;
+      if (IS_SYM_OP(OP_OF(FST(caller))) &&
+          (val = find_value(SND(frames[i+1]), SND(caller))) &&
+          TAG_MASK(FST(val)) == PROC_TAG &&
+          ADDR_MASK(FST(val)) == code)
+        name = (char*)SND(caller);
+    }
+    if (name) profile_str(name);
+    else if (i+1 == n && !truncated) fputs("toplevel", profile_out);
+    else profile_cells(SND(code));
+    fputc(i ? ';' : ' ', profile_out);
+  }
+  fputs("1\n", profile_out);
+#undef PROFILE_SLOT
+}
+#define PROFILE_POINT() if (profile_pending) take_sample()
+#else
+#define PROFILE_POINT()
+#endif
+
+void push_frame(void) {
+  /* Moves the frame on the top of the stack onto the return stack. */
+  ASSERT(FP + 2 < (ulong*)(M+FEND), "Return stack overflow!");
+  FP += 2;
+  FST(FP) = SP[0];
+  SND(FP) = SP[1];
+  SP+=2;
+  ++depth;
+  if (depth > stats.max_depth) stats.max_depth = depth;
+}
+
+/* done before every op, including the second of a superinstruction */
+#define STACK_CHECK()                                                   \
+  ASSERT(SP-2 > (ulong*)(M+DEND), "Stack overflow!");                   \
+  if (SP < stats.min_sp) stats.min_sp = SP
+
+/* Dispatch. With GCC's labels as values, every handler ends by jumping
+   straight to the handler of the next op through op_labels, so each
+   has an indirect jump of its own for the branch predictor to learn
+   from, rather than all of them sharing the one at the top of the
+   switch. A primitive found through a symbol or baked into a body
+   jumps the same way to the handler of PRIM_OP of its index. Building
+   with -DNO_COMPUTED_GOTO, or with a compiler that doesn't have the
+   extension, goes back around through the switch every time. */
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+#ifdef COMPUTED_GOTO
+#define HANDLER(op) case op: handle_##op
+#define PRIM_HANDLER(name) case PRIM_OP(PRIM_##name): handle_PRIM_##name
+#define GOTO_OP goto *op_labels[op]
+#define DISPATCH                                \
+  {                                             \
+    if (FP == FRAME_BASE) return;               \
+    OP_PRELUDE();                               \
+    op = OP;                                    \
+    goto *op_labels[op];                        \
+  }
+#else
+#define HANDLER(op) case op
+#define PRIM_HANDLER(name) case PRIM_OP(PRIM_##name)
+#define GOTO_OP goto dispatch
+#define DISPATCH goto eval_outer
+#endif
+#define OP_PRELUDE()                                                    \
+  SANITY(                                                               \
+         ASSERT(TAG_MASK(FST(PROC)) == PC_TAG,                          \
+                "Non frame on return stack!");                          \
+         ASSERT(TAG_MASK(FST(PC)) == OP_TAG,                            \
+                "Frame doesn't point at an op!");                       \
+         );                                                             \
+  STACK_CHECK();                                                        \
+  SANITY(ASSERT(c_roots_top == 0, "C roots left registered!"));         \
+  ++stats.ops[OP];                                                      \
+  COUNT_PAIR();                                                         \
+  PROFILE_POINT()
+#ifdef OP_PAIRS
+#define COUNT_PAIR()                                                    \
+  {                                                                     \
+    ++stats.pairs[stats.last_op][OP];                                   \
+    stats.last_op = OP;                                                 \
+  }
+#else
+#define COUNT_PAIR()
+#endif
+/* move the pc of the current procedure forward */
+#define NEXT                                    \
+  {                                             \
+    INC_PC;                                     \
+    DISPATCH;                                   \
+  }
+/* Done with the value of a symbol, or with a primitive. The op that
+   got us here may be the first of a pair, and popr may have left
+   nothing to run. */
+#define SYM_DONE                                                \
+  {                                                             \
+    if (FP != FRAME_BASE && IS_FUSED(OP)) goto fused;           \
+    NEXT;                                                       \
+  }
+
+void p_missing(void);
+void eval() {
+  ulong op;
+  ulong* val;
+#ifdef COMPUTED_GOTO
+  static void* op_labels[PRIM_OP(MAX_PRIMS) + 1] = {
+    [OP_RET] = &&handle_OP_RET,
+    [OP_NIL] = &&handle_OP_NIL,
+    [OP_INT] = &&handle_OP_INT,
+    [OP_QSYM] = &&handle_OP_QSYM,
+    [OP_QUOTE] = &&handle_OP_QUOTE,
+    [OP_CLOSURE] = &&handle_OP_CLOSURE,
+    [OP_SYM] = &&handle_OP_SYM,
+    [OP_CELL] = &&handle_OP_CELL,
+    [OP_BADQUOTE] = &&handle_OP_BADQUOTE,
+    [OP_SPUSH] = &&handle_OP_SPUSH,
+    [OP_SPOPS] = &&handle_OP_SPOPS,
+    [OP_SPOPE] = &&handle_OP_SPOPE,
+    [OP_GSYM] = &&handle_OP_GSYM,
+    [OP_INT_NEXT] = &&handle_OP_INT_NEXT,
+    [OP_SYM_NEXT] = &&handle_OP_SYM_NEXT,
+    [OP_GSYM_NEXT] = &&handle_OP_GSYM_NEXT,
+    [OP_SPUSH_NEXT] = &&handle_OP_SPUSH_NEXT,
+    [OP_SPOPE_NEXT] = &&handle_OP_SPOPE_NEXT,
+    [OP_CLOSURE_NEXT] = &&handle_OP_CLOSURE_NEXT,
+    [PRIM_OP(PRIM_PUSH)] = &&handle_PRIM_PUSH,
+    [PRIM_OP(PRIM_PUSHR)] = &&handle_PRIM_PUSHR,
+    [PRIM_OP(PRIM_POPR)] = &&handle_PRIM_POPR,
+    [PRIM_OP(PRIM_EQ)] = &&handle_PRIM_EQ,
+    [PRIM_OP(PRIM_CAR)] = &&handle_PRIM_CAR,
+    [PRIM_OP(PRIM_CDR)] = &&handle_PRIM_CDR,
+    [PRIM_OP(PRIM_CSWAP)] = &&handle_PRIM_CSWAP,
+    [PRIM_OP(PRIM_DUP)] = &&handle_PRIM_DUP,
+    [PRIM_OP(PRIM_DROP)] = &&handle_PRIM_DROP,
+    [PRIM_OP(PRIM_ADD)] = &&handle_PRIM_ADD,
+    [PRIM_OP(PRIM_SUB)] = &&handle_PRIM_SUB,
+    [PRIM_OP(PRIM_MUL)] = &&handle_PRIM_MUL,
+    [PRIM_OP(N_INLINE_PRIMS) ... PRIM_OP(MAX_PRIMS) - 1] = &&prim_call,
+    [PRIM_OP(PRIM_MISSING)] = &&handle_PRIM_MISSING,
+  };
+  _Static_assert (N_OPS == OP_CLOSURE_NEXT + 1, "op missing from op_labels");
+  _Static_assert (N_INLINE_PRIMS == PRIM_MUL + 1,
+                  "primitive missing from op_labels");
+#endif
+#ifndef COMPUTED_GOTO
+ eval_outer:
+#endif
+  if (FP == FRAME_BASE) return;
+  OP_PRELUDE();
+  op = OP;
+#ifndef COMPUTED_GOTO
+ dispatch:
+#endif
+  switch (op) {
+  HANDLER(OP_RET):
+    // exhausted the body of the procedure, pop from ret stack
+    --depth;
+    FP -= 2;
+    if (depth == 0) return;
+    NEXT;
+  HANDLER(OP_NIL):
+    PUSH(NIL_TAG, 0);
+    NEXT;
+  HANDLER(OP_INT):
+    PUSH(INT_TAG, ARG);
+    NEXT;
+  HANDLER(OP_QSYM):
+    PUSH(SYM_TAG, ARG);
+    NEXT;
+  HANDLER(OP_QUOTE):
+    {
+      /* the only immediate quoted this way is a sigil */
+      cell c = deref(ARG);
+      PUSH(c.car, c.cdr);
+    }
+    NEXT;
+  HANDLER(OP_CLOSURE):
+    PUSH(ARG | PROC_TAG, (ulong)(*ENV));
+    SEAL_ENV(*ENV);
+    NEXT;
+  HANDLER(OP_SPUSH):
+    {
+      ulong* val = lookup(*ENV, ARG);
+      PUSH(FST(val), SND(val));
+    }
+    NEXT;
+  HANDLER(OP_SPOPS):
+    PUSH(SYM_TAG, ARG);
+    p_pops();
+    NEXT;
+  HANDLER(OP_SPOPE):
+    PUSH(SYM_TAG, ARG);
+    p_pope();
+    NEXT;
+  HANDLER(OP_INT_NEXT):
+    PUSH(INT_TAG, ARG);
+    goto fused;
+  HANDLER(OP_SPUSH_NEXT):
+    {
+      ulong* val = lookup(*ENV, ARG);
+      PUSH(FST(val), SND(val));
+    }
+    goto fused;
+  HANDLER(OP_SPOPE_NEXT):
+    PUSH(SYM_TAG, ARG);
+    p_pope();
+    goto fused;
+  HANDLER(OP_CLOSURE_NEXT):
+    PUSH(ARG | PROC_TAG, (ulong)(*ENV));
+    SEAL_ENV(*ENV);
+  fused:
+    /* the second op of a pair */
     INC_PC;
+    STACK_CHECK();
+    ++stats.fused;
+    op = OP;
+    GOTO_OP;
+  HANDLER(OP_GSYM):
+  HANDLER(OP_GSYM_NEXT):
+    if (IS_LOCAL_SYM(ARG)) {
+      /* bound in a call since, so it has to be looked up again */
+      FST(PC) = OP_WORD(OP_IDX(FST(PC)),
+                        (OP == OP_GSYM) ? OP_SYM : OP_SYM_NEXT);
+      goto sym;
+    }
+    val = global_value((gbinding*)(M+GSTART) + OP_GSLOT(FST(PC)));
+    goto sym_value;
+  HANDLER(OP_SYM):
+  HANDLER(OP_SYM_NEXT):
+  sym:
+    if (IS_LOCAL_SYM(ARG)) {
+      val = lookup(*ENV, ARG);
+    } else {
+      gbinding* b = genv_find((char*)ARG);
+      if (!b->sym) lookup(*ENV, ARG);
+      /* the binding never moves, so this op can remember where it is */
+      FST(PC) = GSYM_WORD(OP_WORD(OP_IDX(FST(PC)),
+                                  (OP == OP_SYM) ? OP_GSYM : OP_GSYM_NEXT),
+                          b - (gbinding*)(M+GSTART));
+      val = global_value(b);
+    }
+  sym_value:
+    {
+      /* act on interal value */
+      switch (VAL_TAG(FST(val))) {
+      case NIL_TAG:
+      case INT_TAG:
+      case VEC_TAG:
+      case BUF_TAG:
+        PUSH(FST(val), SND(val));
+        break;
+      case CONS_TAG:
+        /* run as a body, which needs a cell of its own since val
+           may be a slot in an environment frame */
+        PUSH(FST(val), SND(val));
+        {
+          ulong* body = new_cons(SP[0], SP[1]);
+          SP[0] = (ulong)body | PROC_TAG;
+          SP[1] = (ulong)(*ENV);
+        }
+        SEAL_ENV(*ENV);
+        break;
+      case SYM_TAG:
+      case SIGIL_TAG:
+        /* act as if quoted */
+        PUSH(FST(val), SND(val));
+        break;
+      case PROC_TAG:
+        INSTALL(val);
+        DISPATCH;
+      case PRIM_TAG:
+        op = PRIM_OP(SND(val));
+        GOTO_OP;
+      default:
+        panic("Unknown tag in eval while executing symbol!");
+      }
+    }
+    SYM_DONE;
+  HANDLER(OP_CELL):
+    if (TAG_MASK(FST(ARG)) == PROC_TAG) {
+      INSTALL(ARG);
+      DISPATCH;
+    }
+    op = PRIM_OP(SND(ARG));
+    GOTO_OP;
+  HANDLER(OP_BADQUOTE):
+    panic("No data followed a quote in eval!");
+
+  PRIM_HANDLER(PUSH):
+    p_push();
+    SYM_DONE;
+  PRIM_HANDLER(PUSHR):
+    /* INC_PC happens internally */
+    p_pushr();
+    DISPATCH;
+  PRIM_HANDLER(POPR):
+    p_popr();
+    SYM_DONE;
+  PRIM_HANDLER(EQ):
+    p_eq();
+    SYM_DONE;
+  PRIM_HANDLER(CAR):
+    p_car();
+    SYM_DONE;
+  PRIM_HANDLER(CDR):
+    p_cdr();
+    SYM_DONE;
+  PRIM_HANDLER(CSWAP):
+    p_cswap();
+    SYM_DONE;
+  PRIM_HANDLER(DUP):
+    p_dup();
+    SYM_DONE;
+  PRIM_HANDLER(DROP):
+    p_drop();
+    SYM_DONE;
+  PRIM_HANDLER(ADD):
+    p_add();
+    SYM_DONE;
+  PRIM_HANDLER(SUB):
+    p_sub();
+    SYM_DONE;
+  PRIM_HANDLER(MUL):
+    p_mul();
+    SYM_DONE;
+  PRIM_HANDLER(MISSING):
+    p_missing();
+    SYM_DONE;
+  default:
+#ifdef COMPUTED_GOTO
+  prim_call:
+#endif
+    if (op < PRIM_OP(N_INLINE_PRIMS)) panic("Unknown op in eval!");
+    prims[op - N_OPS].prim();
+    SYM_DONE;
   }
 }
 
@@ -804,61 +2649,117 @@ void p_push (void) {
   *(SP+1) = *(h+1);
   *SP = *h;
 }
+void extend_env(void) {
+  /* Gives the current frame an environment frame with room for another
+     binding. A frame only this call can see is grown by copying it,
+     otherwise a new frame goes in front, sized by the number of popes
+     in the body being run. */
+  ulong* env = *ENV;
+  char grow = IS_ENV(env) && !ENV_SEALED(env);
+  ulong nslots;
+  if (grow) {
+    nslots = 2*ENV_SLOTS(env);
+  } else {
+    ulong* code = PC - 2*OP_IDX(FST(PC));
+    nslots = SND(code + 2*(HDR_CELLS(FST(code)) - 1));
+    if (nslots < ENV_MIN_SLOTS) nslots = ENV_MIN_SLOTS;
+    nslots = (nslots + 1) & ~1ULL;
+  }
+  ulong* new = new_obj(ENV_CELLS(nslots), ENV_KIND);
+  env = *ENV;
+  if (grow) {
+    ulong used = ENV_USED(env);
+    SND(new) = SND(env);
+    ENV_USED(new) = used;
+    for (ulong i = 0; i < used; ++i) {
+      ENV_SYMS(new)[i] = ENV_SYMS(env)[i];
+      FST(ENV_VAL(new, i)) = FST(ENV_VAL(env, i));
+      SND(ENV_VAL(new, i)) = SND(ENV_VAL(env, i));
+    }
+  } else {
+    SND(new) = env;
+  }
+  *ENV = new;
+  /* no barrier, frames are roots */
+}
 void p_pope (void) {
   if (*SP != SYM_TAG) panic("pope on non-sym!");
-  ulong* s = new_cons(*SP, *(SP+1));
-  *(SP) = (ulong) s | CONS_TAG;
-  *(SP+1) = 0;
-  ulong* tmp = new_cons(*(SP+2), *(SP+3));
-  *(SP+1) = tmp;
-  *(SP+2) = 0 | CONS_TAG;
-  *(SP+3) = 0;
-  *(SP+3) = new_cons(*SP, *(SP+1));
-  *(SP+2) = new_cons(*(SP+3), *ENV);
-  *ENV = *(SP+2);
+  if (TOPLEVEL) {
+    ulong* val = box(*(SP+2), *(SP+3));
+    gbinding* b = genv_find((char*)*(SP+1));
+    b->sym = (char*)*(SP+1);
+    b->val = val;
+    WRITE_BARRIER_WORD(&b->val);
+    SP+=4;
+    return;
+  }
+  char* sym = (char*)SP[1];
+  ulong* env = *ENV;
+  ulong i = 0;
+  if (IS_ENV(env) && !ENV_SEALED(env)) {
+    /* nothing else can see this frame, so a rebinding can reuse its
+       slot */
+    char** syms = ENV_SYMS(env);
+    while (i < ENV_USED(env) && syms[i] != sym) ++i;
+  }
+  if (!IS_ENV(env) || ENV_SEALED(env) || i == ENV_SLOTS(env)) {
+    /* the symbol and value stay on the stack until the binding is
+       made */
+    extend_env();
+    env = *ENV;
+    i = ENV_USED(env);
+  }
+  if (i == ENV_USED(env)) {
+    SYM_FLAGS(sym) |= SYM_LOCAL;
+    ENV_SYMS(env)[i] = sym;
+    ++ENV_USED(env);
+    CHANGE_BARRIER(env);
+  }
+  ulong* slot = ENV_VAL(env, i);
+  FST(slot) = SP[2];
+  SND(slot) = SP[3];
+  WRITE_BARRIER(slot);
   SP+=4;
 }
 void p_pops (void) {
   if (*SP != SYM_TAG) panic("pops on non-sym!");
   char* target = (char*)SP[1];
-  ulong* s = new_cons(*SP, *(SP+1));
-  *(SP) = (ulong)s | CONS_TAG;
-  *(SP+1) = 0;
-  ulong* val = new_cons(*(SP+2), *(SP+3));
-  *(SP+1) = val;
   ulong* env = *ENV;
-  while (TAG_MASK(FST(env)) == CONS_TAG) {
-    ulong* pair = FST(env);
-    ulong* cursym = FST(pair);
-    ulong _len;
-    if (streq(&_len, target, (char*)SND(cursym))) {
-      SND(pair) = val;
-      SP+=4;
-      return;
+  while (IS_ENV(env)) {
+    char** syms = ENV_SYMS(env);
+    for (ulong i = ENV_USED(env); i-- > 0;) {
+      if (syms[i] == target) {
+        ulong* slot = ENV_VAL(env, i);
+        FST(slot) = SP[2];
+        SND(slot) = SP[3];
+        WRITE_BARRIER(slot);
+        SP+=4;
+        return;
+      }
     }
     env = SND(env);
   }
   if (TAG_MASK(FST(env)) != NIL_TAG) panic("Mallformed env in set!");
-  print_err((char*)*(SP+1));
+  gbinding* b = genv_find(target);
+  if (b->sym) {
+    ulong* val = box(SP[2], SP[3]);
+    b = genv_find(target);
+    b->val = val;
+    WRITE_BARRIER_WORD(&b->val);
+    SP+=4;
+    return;
+  }
+  print_err(target);
   panic(": undefined symbol (set)!");
 }
 
 void p_pushr (void) {
   if (TAG_MASK(*SP) != PROC_TAG) panic("pushr on non-proc!");
-  /* expects a proc */                                                  \
-  /* explicity copy of the children of cnt to prevent mutation */       \
-  ulong* h = new_cons(SP[0], SP[1]);                                    \
-  SP[0] = (ulong)h | CONS_TAG;                                          \
-  h = new_cons(return_stack.car, return_stack.cdr);                     \
-  SP[1] = h;                                                            \
-  ++depth;                                                              \
-  return_stack.car = FST(SP);                                           \
-  return_stack.cdr = SND(SP);                                           \
-  SP+=2;
+  to_frame();
+  push_frame();
 }
 void p_popr (void) {
-  return_stack.car = FST(return_stack.cdr);
-  return_stack.cdr = SND(return_stack.cdr);
+  FP -= 2;
   --depth;
 }
 
@@ -883,25 +2784,26 @@ void p_eq (void) {
   }
 }
 void p_cons (void) {
-  ulong* car = new_cons(*SP, *(SP+1));
-  *SP = CONS_TAG;
-  *(SP+1) = car;
-  ulong* cdr = new_cons(*(SP+2), *(SP+3));
+  ROOTS_BEGIN;
+  ulong* car = box(SP[0], SP[1]);
+  ROOT_WORD(car);
+  ulong* cdr = box(SP[2], SP[3]);
+  ROOTS_END;
   SP+=2;
-  *SP = ((ulong)car) | CONS_TAG;
-  *(SP+1) = cdr;
+  SP[0] = (ulong)car | CONS_TAG;
+  SP[1] = cdr;
 }
 void p_car (void) {
-  if (TAG_MASK(*SP) != CONS_TAG) panic("Non-cons in car!");
-  ulong* h = ADDR_MASK(*SP);
-  *SP = FST(h);
-  *(SP+1) = SND(h);
+  if (VAL_TAG(*SP) != CONS_TAG) panic("Non-cons in car!");
+  cell h = deref(*SP);
+  *SP = h.car;
+  *(SP+1) = h.cdr;
 }
 void p_cdr (void) {
-  if (TAG_MASK(SP) != CONS_TAG) panic("Non-cons in car!");
-  ulong* h = *(SP+1);
-  *SP = FST(h);
-  *(SP+1) = SND(h);
+  if (VAL_TAG(*SP) != CONS_TAG) panic("Non-cons in cdr!");
+  cell h = deref(*(SP+1));
+  *SP = h.car;
+  *(SP+1) = h.cdr;
 }
 void p_cswap (void) {
   char b = (*(SP) == SYM_TAG) && (*(SP+1) == T_SYM);
@@ -915,7 +2817,7 @@ void p_cswap (void) {
   }
 }
 void p_tag (void) {
-  *(SP+1) = TAG_MASK(*SP);
+  *(SP+1) = VAL_TAG(*SP);
   *SP = INT_TAG;
 }
 void p_read (void) {
@@ -927,13 +2829,184 @@ void p_print (void) {
   SP+=2;
 }
 
+/* Each counter is found by its offset into stats, which is different
+   for every thread. */
+#define STAT(field) ((ulong)&((struct stats*)0)->field)
+#define STAT_VALUE(i) (*(ulong*)((char*)&stats + stat_entries[i].offset))
+struct stat_entry {char* name; ulong offset;};
+struct stat_entry stat_entries[] = {
+  {"conses", STAT(conses)},
+  {"objects", STAT(objs)},
+  {"minor-gcs", STAT(minor_gcs)},
+  {"minor-survival%", STAT(minor_survival)},
+  {"full-gcs", STAT(full_gcs)},
+  {"full-survival%", STAT(full_survival)},
+  {"heap-grows", STAT(grows)},
+  {"semispace-bytes", STAT(semispace_bytes)},
+  {"bytes-copied", STAT(copied)},
+  {"pause-ns", STAT(pause_total)},
+  {"pause-avg-ns", STAT(pause_avg)},
+  {"pause-max-ns", STAT(pause_max)},
+  {"incremental-cycles", STAT(incr_cycles)},
+  {"incremental-steps", STAT(incr_steps)},
+  {"step-pause-max-ns", STAT(step_pause_max)},
+  {"pauses-over-limit", STAT(pauses_over)},
+  {"installs", STAT(installs)},
+  {"tail-calls", STAT(tail_calls)},
+  {"max-depth", STAT(max_depth)},
+  {"peak-stack-bytes", STAT(peak_stack)},
+  {"run-ns", STAT(run_ns)},
+  {"ops", STAT(total_ops)},
+  {"op-ret", STAT(ops[OP_RET])},
+  {"op-nil", STAT(ops[OP_NIL])},
+  {"op-int", STAT(ops[OP_INT])},
+  {"op-qsym", STAT(ops[OP_QSYM])},
+  {"op-quote", STAT(ops[OP_QUOTE])},
+  {"op-closure", STAT(ops[OP_CLOSURE])},
+  {"op-sym", STAT(ops[OP_SYM])},
+  {"op-cell", STAT(ops[OP_CELL])},
+  {"op-spush", STAT(ops[OP_SPUSH])},
+  {"op-spops", STAT(ops[OP_SPOPS])},
+  {"op-spope", STAT(ops[OP_SPOPE])},
+  {"op-gsym", STAT(ops[OP_GSYM])},
+  {"op-int-next", STAT(ops[OP_INT_NEXT])},
+  {"op-sym-next", STAT(ops[OP_SYM_NEXT])},
+  {"op-gsym-next", STAT(ops[OP_GSYM_NEXT])},
+  {"op-spush-next", STAT(ops[OP_SPUSH_NEXT])},
+  {"op-spope-next", STAT(ops[OP_SPOPE_NEXT])},
+  {"op-closure-next", STAT(ops[OP_CLOSURE_NEXT])},
+  {"ops-fused", STAT(fused)},
+};
+#define N_STATS (sizeof(stat_entries) / sizeof(struct stat_entry))
+
+void update_stats() {
+  ulong gcs = stats.minor_gcs + stats.full_gcs + stats.incr_steps;
+  stats.minor_survival =
+    stats.minor_seen ? (100 * stats.minor_kept) / stats.minor_seen : 0;
+  stats.full_survival =
+    stats.full_seen ? (100 * stats.full_kept) / stats.full_seen : 0;
+  stats.pause_avg = gcs ? stats.pause_total / gcs : 0;
+  stats.peak_stack = (char*)(M+SSTART) - (char*)stats.min_sp;
+  stats.run_ns = now_ns() - stats.start_ns;
+  stats.semispace_bytes = SEMIHEAPSIZE;
+  stats.total_ops = 0;
+  for (ulong i = 0; i < N_OPS; ++i) stats.total_ops += stats.ops[i];
+}
+
+void report_stat(void (*out)(char*), char* name, ulong v) {
+  char buf[24];
+  char* d = buf + sizeof(buf);
+  *(--d) = 0;
+  *(--d) = '\n';
+  do {
+    *(--d) = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  *(--d) = ' ';
+  out(name);
+  out(d);
+}
+
+#ifdef OP_PAIRS
+char* op_stat_name(ulong op) {
+  /* "-ret" for OP_RET, and so on, from its op- entry */
+  for (ulong i = 0; i < N_STATS; ++i)
+    if (stat_entries[i].offset == STAT(ops[op])) return stat_entries[i].name + 2;
+  return "-?";
+}
+#endif
+
+void report_stats(void (*out)(char*)) {
+  /* One "name value" line per counter. */
+  update_stats();
+  for (ulong i = 0; i < N_STATS; ++i)
+    report_stat(out, stat_entries[i].name, STAT_VALUE(i));
+#ifdef OP_PAIRS
+  /* and a "pair-first-second count" line for each pair of ops that
+     were dispatched one after the other, named after their op- entry */
+  for (ulong a = 0; a < N_OPS; ++a)
+    for (ulong b = 0; b < N_OPS; ++b) {
+      if (!stats.pairs[a][b]) continue;
+      out("pair");
+      out(op_stat_name(a));
+      report_stat(out, op_stat_name(b), stats.pairs[a][b]);
+    }
+#endif
+}
+
+void finish(void) {
+  /* End of input. */
+  flush_output();
+  if (stats_at_exit) report_stats(print_err);
+#ifndef BAREMETAL
+  if (profile_out) fclose(profile_out);
+  if (job_exit) longjmp(*job_exit, 1);
+  exit(0);
+#else
+  panic("End of input!");
+#endif
+}
+
+#ifndef BAREMETAL
+void p_load_file (void) {
+  /* Reads the file named by the symbol on the stack ahead of the rest
+     of the input, once the current top level form is done. */
+  if (*SP != SYM_TAG) panic("load_file on non-sym!");
+  char* path = (char*)SP[1];
+  SP+=2;
+  open_source(path);
+}
+#endif
+void p_flush (void) {
+  flush_output();
+}
+void p_clock (void) {
+  PUSH(INT_TAG, now_ns());
+}
+void p_vmstats (void) {
+  report_stats(out_string);
+}
+void p_vmstat (void) {
+  /* Replaces the name of a counter with its value. */
+  if (*SP != SYM_TAG) panic("vmstat on non-sym!");
+  update_stats();
+  ulong len;
+  for (ulong i = 0; i < N_STATS; ++i) {
+    if (streq(&len, stat_entries[i].name, (char*)SP[1])) {
+      SP[0] = INT_TAG;
+      SP[1] = STAT_VALUE(i);
+      return;
+    }
+  }
+  print_err((char*)SP[1]);
+  panic(": unknown counter (vmstat)!");
+}
+
 void p_sstack (void) {
   for (ulong* a = (ulong*)(M+SSTART-16); a >= SP; a-=2) {
     print(a, 1);
   }
 }
 void p_env (void) {
-  PUSH(FST(*ENV), SND(*ENV));
+  /* Pushes the bindings of the current environment as a list of
+     (symbol . value) pairs, innermost first. The frames can move with
+     every cons, so each binding is found again from the top. */
+  ulong n = 0;
+  for (ulong* env = *ENV; IS_ENV(env); env = SND(env)) n += ENV_USED(env);
+  PUSH(NIL_TAG, 0);
+  while (n--) {
+    ulong* env = *ENV;
+    ulong i = n;
+    while (i >= ENV_USED(env)) {
+      i -= ENV_USED(env);
+      env = SND(env);
+    }
+    i = ENV_USED(env) - 1 - i;
+    PUSH(FST(ENV_VAL(env, i)), SND(ENV_VAL(env, i)));
+    PUSH(SYM_TAG, (ulong)ENV_SYMS(env)[i]);
+    p_cons();
+    p_cons();
+  }
 }
 void p_dup (void) {
   SP-=2;
@@ -1039,106 +3112,651 @@ void p_store_4b (void) {
   SP+=4;
 }
 
-ulong* env_define_prim(ulong* env, char* raw_sym, stack_func prim) {
+void p_mkvec (void) {
+  /* n mkvec: a vector of n nils */
+  if (TAG_MASK(*SP) != INT_TAG || SP[1] > HEAPMAX/(2*sizeof(ulong)))
+    panic("Bad length in mkvec!");
+  ulong n = SP[1];
+  ulong* v = new_obj(n + 1, VEC_KIND);
+  for (ulong i = 0; i < n; ++i) FST(VEC_REF(v, i)) = NIL_TAG;
+  SP[0] = VEC_TAG;
+  SP[1] = v;
+}
+void p_vlen (void) {
+  if (TAG_MASK(*SP) != VEC_TAG) panic("Non-vector in vlen!");
+  SP[1] = VEC_LEN(SP[1]);
+  SP[0] = INT_TAG;
+}
+ulong* vec_slot(ulong* at, char* who) {
+  /* The element of the vector at[2] indexed by at[0]. */
+  if (TAG_MASK(at[0]) != INT_TAG || TAG_MASK(at[2]) != VEC_TAG) {
+    print_err(who);
+    panic(": bad vector or index!\n");
+  }
+  if (at[1] >= VEC_LEN(at[3])) {
+    print_err(who);
+    panic(": index out of range!\n");
+  }
+  return VEC_REF((ulong*)at[3], at[1]);
+}
+void p_vref (void) {
+  /* v i vref */
+  ulong* slot = vec_slot(SP, "vref");
+  SP+=2;
+  SP[0] = FST(slot);
+  SP[1] = SND(slot);
+}
+void p_vset (void) {
+  /* x v i vset */
+  ulong* slot = vec_slot(SP, "vset");
+  FST(slot) = SP[4];
+  SND(slot) = SP[5];
+  WRITE_BARRIER(slot);
+  SP+=6;
+}
+
+/* Bulk byte operations for buffers. There is no libc on baremetal, so
+   these are our own: 16 bytes at a time with SSE2 on x86-64, otherwise
+   a word at a time once both sides are aligned alike, and then a byte
+   at a time for whatever is left. The SSE2 side is written with gcc's
+   vector extensions, since the intrinsics headers drag in stdlib.h. */
+#if defined(__SSE2__) && !defined(BAREMETAL)
+#define BULK_SSE2
+typedef char bulk_vec __attribute__((vector_size(16), may_alias, aligned(1)));
+#define BULK_MASK(v) ((unsigned int)__builtin_ia32_pmovmskb128(v))
+#endif
+typedef ulong __attribute__((may_alias)) bulk_word;
+#define BYTES_ONES 0x0101010101010101ULL
+#define BYTES_HIGHS 0x8080808080808080ULL
+#define WORD_ALIGNED_ALIKE(a, b) ((((ulong)(a) ^ (ulong)(b)) & 7) == 0)
+
+void bytes_copy(unsigned char* d, unsigned char* s, ulong n) {
+  /* Like memmove, overlapping ranges are fine. */
+  if (d == s || !n) return;
+  if (d < s || d >= s + n) {
+#ifdef BULK_SSE2
+    for (; n >= 16; n -= 16, d += 16, s += 16) *(bulk_vec*)d = *(bulk_vec*)s;
+#else
+    if (WORD_ALIGNED_ALIKE(d, s)) {
+      for (; n && ((ulong)d & 7); --n) *d++ = *s++;
+      for (; n >= 8; n -= 8, d += 8, s += 8) *(bulk_word*)d = *(bulk_word*)s;
+    }
+#endif
+    while (n--) *d++ = *s++;
+  } else {
+    d += n;
+    s += n;
+#ifdef BULK_SSE2
+    for (; n >= 16; n -= 16) {
+      d -= 16;
+      s -= 16;
+      *(bulk_vec*)d = *(bulk_vec*)s;
+    }
+#else
+    if (WORD_ALIGNED_ALIKE(d, s)) {
+      for (; n && ((ulong)d & 7); --n) *--d = *--s;
+      for (; n >= 8; n -= 8) {
+        d -= 8;
+        s -= 8;
+        *(bulk_word*)d = *(bulk_word*)s;
+      }
+    }
+#endif
+    while (n--) *--d = *--s;
+  }
+}
+
+void bytes_fill(unsigned char* d, unsigned char x, ulong n) {
+#ifdef BULK_SSE2
+  bulk_vec v = (bulk_vec){} + (char)x;
+  for (; n >= 16; n -= 16, d += 16) *(bulk_vec*)d = v;
+#else
+  for (; n && ((ulong)d & 7); --n) *d++ = x;
+  for (; n >= 8; n -= 8, d += 8) *(bulk_word*)d = BYTES_ONES * x;
+#endif
+  while (n--) *d++ = x;
+}
+
+long long bytes_cmp(unsigned char* a, unsigned char* b, ulong n) {
+  /* Like memcmp, the difference of the first bytes that differ. */
+#ifdef BULK_SSE2
+  for (; n >= 16; n -= 16, a += 16, b += 16) {
+    unsigned int m = BULK_MASK(*(bulk_vec*)a == *(bulk_vec*)b) ^ 0xffff;
+    if (m) {
+      ulong i = __builtin_ctz(m);
+      return (long long)a[i] - b[i];
+    }
+  }
+#else
+  if (WORD_ALIGNED_ALIKE(a, b)) {
+    for (; n && ((ulong)a & 7) && *a == *b; --n) ++a, ++b;
+    if (!((ulong)a & 7))
+      for (; n >= 8 && *(bulk_word*)a == *(bulk_word*)b; n -= 8) a += 8, b += 8;
+  }
+#endif
+  for (; n; --n, ++a, ++b)
+    if (*a != *b) return (long long)*a - *b;
+  return 0;
+}
+
+long long bytes_find(unsigned char* p, unsigned char x, ulong n) {
+  /* The index of the first x in p, or -1. */
+  unsigned char* start = p;
+#ifdef BULK_SSE2
+  bulk_vec v = (bulk_vec){} + (char)x;
+  for (; n >= 16; n -= 16, p += 16) {
+    unsigned int m = BULK_MASK(*(bulk_vec*)p == v);
+    if (m) return p - start + __builtin_ctz(m);
+  }
+#else
+  for (; n && ((ulong)p & 7); --n, ++p)
+    if (*p == x) return p - start;
+  for (; n >= 8; n -= 8, p += 8) {
+    /* a byte of w is zero exactly where p matches */
+    ulong w = *(bulk_word*)p ^ (BYTES_ONES * x);
+    if ((w - BYTES_ONES) & ~w & BYTES_HIGHS) break;
+  }
+#endif
+  for (; n; --n, ++p)
+    if (*p == x) return p - start;
+  return -1;
+}
+
+void p_mkbuf (void) {
+  /* n mkbuf: a buffer of n zero bytes */
+  if (TAG_MASK(*SP) != INT_TAG || SP[1] > HEAPMAX)
+    panic("Bad length in mkbuf!");
+  ulong n = SP[1];
+  ulong* b = new_obj(BUF_CELLS(n), BUF_KIND);
+  BUF_LEN(b) = n;
+  SP[0] = BUF_TAG;
+  SP[1] = b;
+}
+void p_blen (void) {
+  if (TAG_MASK(*SP) != BUF_TAG) panic("Non-buffer in blen!");
+  SP[1] = BUF_LEN(SP[1]);
+  SP[0] = INT_TAG;
+}
+unsigned char* buf_span(ulong* at, ulong n, char* who) {
+  /* The bytes of the buffer at[2] starting from the index at[0], after
+     checking that n of them are there. */
+  if (TAG_MASK(at[0]) != INT_TAG || TAG_MASK(at[2]) != BUF_TAG) {
+    print_err(who);
+    panic(": bad buffer or index!\n");
+  }
+  ulong len = BUF_LEN(at[3]);
+  if (at[1] > len || n > len - at[1]) {
+    print_err(who);
+    panic(": index out of range!\n");
+  }
+  return BUF_DATA((ulong*)at[3]) + at[1];
+}
+ulong byte_arg(ulong* at, char* who) {
+  if (TAG_MASK(at[0]) != INT_TAG) {
+    print_err(who);
+    panic(": non-int argument!\n");
+  }
+  return at[1];
+}
+void p_bref (void) {
+  /* b i bref */
+  unsigned char* p = buf_span(SP, 1, "bref");
+  SP+=2;
+  SP[0] = INT_TAG;
+  SP[1] = *p;
+}
+void p_bset (void) {
+  /* x b i bset */
+  unsigned char* p = buf_span(SP, 1, "bset");
+  *p = byte_arg(SP+4, "bset");
+  CHANGE_BARRIER(SP[3]);
+  SP+=6;
+}
+void p_bcopy (void) {
+  /* src i dst j n bcopy: copies n bytes from src at i to dst at j */
+  ulong n = byte_arg(SP, "bcopy");
+  unsigned char* d = buf_span(SP+2, n, "bcopy");
+  unsigned char* s = buf_span(SP+6, n, "bcopy");
+  bytes_copy(d, s, n);
+  CHANGE_BARRIER(SP[5]);
+  SP+=10;
+}
+void p_bfill (void) {
+  /* x b i n bfill: sets n bytes of b from i to x */
+  ulong n = byte_arg(SP, "bfill");
+  unsigned char* d = buf_span(SP+2, n, "bfill");
+  bytes_fill(d, byte_arg(SP+6, "bfill"), n);
+  CHANGE_BARRIER(SP[5]);
+  SP+=8;
+}
+void p_bcmp (void) {
+  /* a i b j n bcmp: compares n bytes, negative, zero or positive */
+  ulong n = byte_arg(SP, "bcmp");
+  unsigned char* b = buf_span(SP+2, n, "bcmp");
+  unsigned char* a = buf_span(SP+6, n, "bcmp");
+  SP+=8;
+  SP[0] = INT_TAG;
+  SP[1] = bytes_cmp(a, b, n);
+}
+void p_bfind (void) {
+  /* x b i bfind: the index of the first x in b from i on, or -1 */
+  unsigned char* p = buf_span(SP, 0, "bfind");
+  long long i = bytes_find(p, byte_arg(SP+4, "bfind"), BUF_LEN(SP[3]) - SP[1]);
+  SP+=4;
+  SP[0] = INT_TAG;
+  SP[1] = (i < 0) ? i : i + SP[-3];
+}
+
+void genv_define_prim(char* raw_sym, ulong prim) {
   // FOR USE ONLY IN STARTUP. NOT GC SAFE
-  return new_cons(new_cons(new_cons(SYM_TAG, raw_sym),
-                           new_cons(PRIM_TAG, prim)),
-                  env);
+  gbinding* b = genv_find(raw_sym);
+  b->sym = raw_sym;
+  b->val = new_cons(PRIM_TAG, prim);
+  WRITE_BARRIER_WORD(&b->val);
 }
 
-void strcpy_inc(char** dest, char* src) {
-  while (*((*dest)++) = *src++) {}
+/* The primitives bound at startup. The index of a primitive in this
+   table is what a PRIM_TAG cell holds, both in the heap and in an
+   image, so the ones eval handles itself come first, at the indices it
+   knows them by, and the ones only some platforms have go last, where
+   they can't shift the rest. */
+void p_save_image(void);
+struct prim_def prims[] = {
+  [PRIM_PUSH] = {"push", p_push},
+  [PRIM_PUSHR] = {"pushr", p_pushr},
+  [PRIM_POPR] = {"popr", p_popr},
+  [PRIM_EQ] = {"eq", p_eq},
+  [PRIM_CAR] = {"car", p_car},
+  [PRIM_CDR] = {"cdr", p_cdr},
+  [PRIM_CSWAP] = {"cswap", p_cswap},
+  [PRIM_DUP] = {"dup", p_dup},
+  [PRIM_DROP] = {"drop", p_drop},
+  [PRIM_ADD] = {"add", p_add},
+  [PRIM_SUB] = {"sub", p_sub},
+  [PRIM_MUL] = {"mul", p_mul},
+  {"pops", p_pops},
+  {"pope", p_pope},
+  /* {"captureroot", p_captureroot}, */
+  {"cons", p_cons},
+  {"tag", p_tag},
+  {"read", p_read},
+  {"print", p_print},
+  {"flush", p_flush},
+  {"sstack", p_sstack},
+  {"vmstats", p_vmstats},
+  {"clock", p_clock},
+  {"vmstat", p_vmstat},
+  {"env", p_env},
+  {"div", p_div},
+  {"mod", p_mod},
+  {"lsh", p_lsh},
+  {"rsh", p_rsh},
+  {"nand", p_nand},
+  {"or", p_or},
+  {"load", p_load},
+  {"store", p_store},
+  {"load_b", p_load_b},
+  {"store_b", p_store_b},
+  {"load_2b", p_load_2b},
+  {"store_2b", p_store_2b},
+  {"load_4b", p_load_4b},
+  {"store_4b", p_store_4b},
+  {"mkvec", p_mkvec},
+  {"vlen", p_vlen},
+  {"vref", p_vref},
+  {"vset", p_vset},
+  {"mkbuf", p_mkbuf},
+  {"blen", p_blen},
+  {"bref", p_bref},
+  {"bset", p_bset},
+  {"bcopy", p_bcopy},
+  {"bfill", p_bfill},
+  {"bcmp", p_bcmp},
+  {"bfind", p_bfind},
+#ifndef BAREMETAL
+  {"load_file", p_load_file},
+  {"save_image", p_save_image},
+#endif
+};
+#define N_PRIMS (sizeof(prims) / sizeof(struct prim_def))
+_Static_assert (N_PRIMS <= MAX_PRIMS, "too many primitives for eval");
+void p_missing (void) {
+  panic("Primitive from an image isn't in this build!");
+}
+
+/* An image is a snapshot of the top level: the symbol table, the
+   global environment, the dictionary and the heap, taken right after a
+   full collection. The stack and the return stack are not saved, so
+   starting from an image drops you at the repl with every definition
+   already made. Loading copies each region into place and then walks
+   it, moving every pointer by however far its region moved, and
+   checking that every primitive is one this build has. Nothing in an
+   image depends on the build that wrote it, so the Makefile bakes one
+   of std.fp into fpir_std and fpir_bm as BAKED_IMAGE. */
+#define IMAGE_MAGIC 0x35474d4952495046ULL /* "FPIRIMG5" */
+struct image_header {
+  ulong magic, symtab_entries;
+  ulong heap_size, dict_size;
+  ulong dict_base, heap_base;
+  ulong dict_used, heap_used;
+  ulong root_env, symcount;
+};
+PER_INTERP char from_image = 0;
+extern char BAKED_IMAGE[] __attribute__((weak));
+
+struct image_header* check_image(struct image_header* h) {
+  /* Makes sure the heap and dictionary will be big enough to take the
+     image. */
+  if (h->magic != IMAGE_MAGIC)
+    quit("Not an image for this version of fpir!\n");
+  if (HEAPSIZE < h->heap_size) HEAPSIZE = h->heap_size;
+  if (HEAPMAX < HEAPSIZE) HEAPMAX = HEAPSIZE;
+  if (DICTSIZE < h->dict_size) DICTSIZE = h->dict_size;
+  return h;
+}
+
+void walk_heap(void (*slot)(ulong*), void (*obj)(ulong*)) {
+  /* Calls slot on every cell in the heap laid out like a stack slot,
+     including the values in environment frames, and obj on every
+     multi-cell object. */
+  for (ulong* c = fromspace; c < HP; c += 2) {
+    if (TAG_MASK(FST(c)) != HDR_TAG) {
+      slot(c);
+      continue;
+    }
+    if (obj) obj(c);
+    if (HDR_KIND(FST(c)) == ENV_KIND) {
+      for (ulong i = 0; i < ENV_USED(c); ++i) slot(ENV_VAL(c, i));
+    } else if (HDR_KIND(FST(c)) == VEC_KIND) {
+      for (ulong i = 0; i < VEC_LEN(c); ++i) slot(VEC_REF(c, i));
+    }
+    c += 2*(HDR_CELLS(FST(c)) - 1);
+  }
 }
 
+PER_INTERP struct image_header* reloc_from;
+ulong reloc_dict(ulong p) {
+  /* p points into the dictionary the image was saved from */
+  if (p >= reloc_from->dict_base &&
+      p < reloc_from->dict_base + reloc_from->dict_used)
+    return p - reloc_from->dict_base + (ulong)(M+DSTART);
+  return p;
+}
+ulong reloc_heap(ulong w) {
+  /* w is a tagged or untagged pointer into the saved heap, or an
+     immediate */
+  if (IS_IMM(w)) return w;
+  ulong a = (ulong)ADDR_MASK(w);
+  if (a >= reloc_from->heap_base &&
+      a < reloc_from->heap_base + reloc_from->heap_used)
+    return w - reloc_from->heap_base + (ulong)fromspace;
+  return w;
+}
+void reloc_slot(ulong* c) {
+  switch (TAG_MASK(FST(c))) {
+  case CONS_TAG:
+  case IMM_TAG:
+  case VEC_TAG:
+  case BUF_TAG:
+  case PROC_TAG:
+  case PC_TAG:
+    FST(c) = reloc_heap(FST(c));
+    SND(c) = reloc_heap(SND(c));
+    break;
+  case SYM_TAG:
+  case SIGIL_TAG:
+    SND(c) = reloc_dict(SND(c));
+    break;
+  case PRIM_TAG:
+    if (SND(c) >= N_PRIMS) SND(c) = PRIM_MISSING;
+    break;
+  }
+}
+void reloc_object(ulong* c) {
+  if (HDR_KIND(FST(c)) == CODE_KIND || HDR_KIND(FST(c)) == ENV_KIND)
+    SND(c) = reloc_heap(SND(c));
+  if (HDR_KIND(FST(c)) == CODE_KIND) {
+    for (ulong i = 1; i < HDR_CELLS(FST(c)); ++i) {
+      ulong* op = c + 2*i;
+      switch (OP_OF(FST(op))) {
+      case OP_QUOTE:
+      case OP_CLOSURE:
+      case OP_CLOSURE_NEXT:
+      case OP_CELL:
+        SND(op) = reloc_heap(SND(op));
+        break;
+      case OP_SYM:
+      case OP_QSYM:
+      case OP_SYM_NEXT:
+      case OP_SPUSH:
+      case OP_SPUSH_NEXT:
+      case OP_SPOPS:
+      case OP_SPOPE:
+      case OP_SPOPE_NEXT:
+        SND(op) = reloc_dict(SND(op));
+        break;
+      case OP_GSYM:
+      case OP_GSYM_NEXT:
+        /* the global environment is built again, so where a binding
+           is has to be found again too */
+        FST(op) = OP_WORD(i, (OP_OF(FST(op)) == OP_GSYM) ? OP_SYM : OP_SYM_NEXT);
+        SND(op) = reloc_dict(SND(op));
+        break;
+      }
+    }
+  } else if (HDR_KIND(FST(c)) == ENV_KIND) {
+    for (ulong i = 0; i < ENV_USED(c); ++i)
+      ENV_SYMS(c)[i] = reloc_dict(ENV_SYMS(c)[i]);
+  }
+}
+
+void load_image(struct image_header* h) {
+  char* src = (char*)(h+1);
+  char** symtab = (char**)(M+TSTART);
+  gbinding* genv = (gbinding*)(M+GSTART);
+  char** saved_symtab = (char**)src;
+  gbinding* saved_genv = (gbinding*)(saved_symtab + h->symtab_entries);
+  src = (char*)(saved_genv + h->symtab_entries);
+  if (h->dict_used > DEND - DSTART || h->heap_used > SEMIHEAPSIZE ||
+      h->symcount >= SYMTAB_ENTRIES - (SYMTAB_ENTRIES / 4))
+    quit("Bad image!\n");
+  for (ulong i = 0; i < h->dict_used; ++i) (M+DSTART)[i] = src[i];
+  src += h->dict_used;
+  for (ulong i = 0; i < h->heap_used; ++i) ((char*)fromspace)[i] = src[i];
+  DP = M+DSTART + h->dict_used;
+  HP = fromspace + h->heap_used / sizeof(ulong);
+  symcount = h->symcount;
+
+  reloc_from = h;
+  for (ulong i = 0; i < SYMTAB_ENTRIES; ++i) {
+    symtab[i] = 0;
+    genv[i].sym = 0;
+    genv[i].val = 0;
+  }
+  /* the tables may not be the size they were, and the global
+     environment is hashed on symbol addresses, so both are built again
+     rather than copied */
+  for (ulong i = 0; i < h->symtab_entries; ++i) {
+    if (!saved_symtab[i]) continue;
+    char* sym = reloc_dict(saved_symtab[i]);
+    ulong j = hash_str(sym) & (SYMTAB_ENTRIES - 1);
+    while (symtab[j]) j = (j + 1) & (SYMTAB_ENTRIES - 1);
+    symtab[j] = sym;
+  }
+  for (ulong i = 0; i < h->symtab_entries; ++i) {
+    if (!saved_genv[i].sym) continue;
+    gbinding* b = genv_find(reloc_dict(saved_genv[i].sym));
+    b->sym = reloc_dict(saved_genv[i].sym);
+    b->val = reloc_heap(saved_genv[i].val);
+  }
+  root_env = reloc_heap(h->root_env);
+  walk_heap(reloc_slot, reloc_object);
+  from_image = 1;
+}
+
+#ifndef BAREMETAL
+char* image_path = 0;
+
+void p_save_image (void) {
+  /* Writes an image to the file named by the symbol on the stack. */
+  if (*SP != SYM_TAG) panic("save_image on non-sym!");
+  char* path = (char*)SP[1];
+  SP+=2;
+  collect();
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    print_err(path);
+    panic(": can't write image!\n");
+  }
+  struct image_header h = {
+    .magic = IMAGE_MAGIC,
+    .symtab_entries = SYMTAB_ENTRIES,
+    .heap_size = NURSERYSIZE + 2*SEMIHEAPSIZE,
+    .dict_size = DEND - DSTART,
+    .dict_base = (ulong)(M+DSTART),
+    .heap_base = (ulong)fromspace,
+    .dict_used = (ulong)RND_UP(DP - (M+DSTART)),
+    .heap_used = (char*)HP - (char*)fromspace,
+    .root_env = (ulong)root_env,
+    .symcount = symcount,
+  };
+  fwrite(&h, sizeof(h), 1, out);
+  fwrite(M+TSTART, 1, RSTART - TSTART, out);
+  fwrite(M+DSTART, 1, h.dict_used, out);
+  fwrite(fromspace, 1, h.heap_used, out);
+  fclose(out);
+}
+#endif
+
+char image_fits(struct image_header* h, ulong len) {
+  /* Whether a file of len bytes holds everything its header says it
+     does, checked a part at a time so that nothing can overflow. */
+  if (len < sizeof(*h)) return 0;
+  len -= sizeof(*h);
+  if (h->symtab_entries > len / (sizeof(char*) + sizeof(gbinding))) return 0;
+  len -= h->symtab_entries * (sizeof(char*) + sizeof(gbinding));
+  if (h->dict_used > len) return 0;
+  len -= h->dict_used;
+  return h->heap_used <= len;
+}
+
+struct image_header* open_image(ulong* len) {
+  /* The image to start from, if there is one, checked and, if it is a
+     file, mapped. */
+  struct image_header* image = BAKED_IMAGE ? (struct image_header*)BAKED_IMAGE : 0;
+#ifndef BAREMETAL
+  if (image_path) image = (struct image_header*)map_file(image_path, len);
+  if (image_path && !image_fits(image, *len)) {
+    print_err(image_path);
+    quit(": bad image!\n");
+  }
+#endif
+  if (image) check_image(image);
+  return image;
+}
+
+#ifndef BAREMETAL
+struct image_header* batch_image = 0;
+// ^ opened once for every job, see run_batch
+#endif
+
 int forsp_main() {
+  struct image_header* image;
+  ulong image_len = 0;
+#ifndef BAREMETAL
+  if (batch_jobs) image = batch_image;
+  else
+#endif
+  image = open_image(&image_len);
+  layout();
 #ifdef BAREMETAL
+  /* everything lives in MAINMEM, one region after the other */
   M = &MAINMEM;
+  nursery = M+MEMSIZE;
+  fromspace = (ulong*)((char*)nursery + NURSERYSIZE);
+  if (gc_compact) {
+    markbits = (ulong*)((char*)fromspace + SEMIHEAPSIZE);
+    markoffs = markbits + mark_words(SEMIHEAPSIZE);
+    for (ulong i = 0; i < mark_words(SEMIHEAPSIZE); ++i) markbits[i] = 0;
+  } else {
+    tospace = (ulong*)((char*)fromspace + SEMIHEAPSIZE);
+  }
+  if (gc_pause_limit) {
+    fwdtab = (ulong*)((char*)tospace + SEMIHEAPSIZE);
+    for (ulong i = 0; i < SEMIHEAPSIZE/16; ++i) fwdtab[i] = 0;
+  }
+#else
+  M = map_region(MEMSIZE);
+  nursery = map_region(NURSERYSIZE);
+  if (gc_compact) {
+    /* room to grow into, which costs nothing until it is used */
+    fromspace = map_region(compact_semi(HEAPMAX));
+    markbits = map_region(2*sizeof(ulong)*mark_words(compact_semi(HEAPMAX)));
+    markoffs = markbits + mark_words(compact_semi(HEAPMAX));
+  } else {
+    fromspace = map_region(SEMIHEAPSIZE);
+    tospace = map_region(SEMIHEAPSIZE);
+  }
+  if (gc_pause_limit) fwdtab = map_region(SEMIHEAPSIZE/2);
 #endif
   ASSERT(((ulong)M & 0xf) == 0, "Memory base isn't 16byte aligned!");
 
   SP = M+SSTART;
-  HP = M+HSTART;
-  fromspace = HP;
-  tospace = (ulong*)(((ulong)HP) + SEMIHEAPSIZE);
+  stats.min_sp = SP;
+  stats.start_ns = now_ns();
+  YP = nursery;
+  ylimit = NURSERY_END;
+  HP = fromspace;
 
-  char* dict = (char*)M;
-  root_env = new_cons(NIL_TAG, 0);
-#define BAKE_DEF(cstr, prim)                            \
-  {                                                     \
-    root_env = env_define_prim(root_env, dict, prim);   \
-    strcpy_inc(&dict, cstr);                            \
+  if (image) {
+    load_image(image);
+#ifndef BAREMETAL
+    if (image_len) munmap(image, image_len);
+#endif
+  } else {
+    char** symtab = (char**)(M+TSTART);
+    gbinding* genv = (gbinding*)(M+GSTART);
+    for (ulong i = 0; i < SYMTAB_ENTRIES; ++i) {
+      symtab[i] = 0;
+      genv[i].sym = 0;
+      genv[i].val = 0;
+    }
+    DP = M+DSTART;
+    root_env = new_cons(NIL_TAG, 0);
+  }
+  /* an image already has the primitives, and maybe something else
+     bound to their names */
+  if (!from_image) {
+    for (ulong i = 0; i < N_PRIMS; ++i)
+      genv_define_prim(intern(prims[i].name), i);
   }
 
   // strings for special syntax forms
-  SQUOTE_SYM = dict;
-  strcpy_inc(&dict, "'");
-  SPUSH_SYM = dict;
-  strcpy_inc(&dict, "$");
-  SPOP_SET_SYM = dict;
-  strcpy_inc(&dict, "^");
-  SPOP_EXT_SYM = dict;
-  strcpy_inc(&dict, ":");
-  OPAREN_SYM = dict;
-  strcpy_inc(&dict, "(");
-  CPAREN_SYM = dict;
-  strcpy_inc(&dict, ")");
-  T_SYM = dict;
-  strcpy_inc(&dict, "t");
-  QUOTE_SYM = dict;
-  strcpy_inc(&dict, "quote");
-
-  // primitives
-  PUSH_SYM = dict;
-  BAKE_DEF("push", p_push);
-  POP_SET_SYM = dict;
-  BAKE_DEF("pops", p_pops);
-  POP_EXT_SYM = dict;
-  BAKE_DEF("pope", p_pope);
-  PUSHR_SYM = dict;
-  BAKE_DEF("pushr", p_pushr);
-  BAKE_DEF("popr", p_popr);
-  /*
-   * ulong* mkproc_sym = dict;
-   * BAKE_DEF("captureroot", p_captureroot);
-   */
-
-  BAKE_DEF("eq", p_eq);
-  CONS_SYM = dict;
-  BAKE_DEF("cons", p_cons);
-  BAKE_DEF("car", p_car);
-  BAKE_DEF("cdr", p_cdr);
-  BAKE_DEF("cswap", p_cswap);
-  BAKE_DEF("tag", p_tag);
-  READ_SYM = dict;
-  BAKE_DEF("read", p_read);
-  PRINT_SYM = dict;
-  BAKE_DEF("print", p_print);
-
-  BAKE_DEF("sstack", p_sstack);
-  BAKE_DEF("env", p_env);
-  BAKE_DEF("dup", p_dup);
-  BAKE_DEF("drop", p_drop);
-  BAKE_DEF("add", p_add);
-  BAKE_DEF("sub", p_sub);
-  BAKE_DEF("mul", p_mul);
-  BAKE_DEF("div", p_div);
-  BAKE_DEF("mod", p_mod);
-  BAKE_DEF("lsh", p_lsh);
-  BAKE_DEF("rsh", p_rsh);
-  BAKE_DEF("nand", p_nand);
-  BAKE_DEF("or", p_or);
-
-  BAKE_DEF("load", p_load);
-  BAKE_DEF("store", p_store);
-  BAKE_DEF("load_b", p_load_b);
-  BAKE_DEF("store_b", p_store_b);
-  BAKE_DEF("load_2b", p_load_2b);
-  BAKE_DEF("store_2b", p_store_2b);
-  BAKE_DEF("load_4b", p_load_4b);
-  BAKE_DEF("store_4b", p_store_4b);
-
-  DP = dict;
+  SQUOTE_SYM = intern("'");
+  SPUSH_SYM = intern("$");
+  SPOP_SET_SYM = intern("^");
+  SPOP_EXT_SYM = intern(":");
+  OPAREN_SYM = intern("(");
+  CPAREN_SYM = intern(")");
+  T_SYM = intern("t");
+  QUOTE_SYM = intern("quote");
+
+  // primitives the interpreter itself looks for
+  PUSH_SYM = intern("push");
+  POP_SET_SYM = intern("pops");
+  POP_EXT_SYM = intern("pope");
+  PUSHR_SYM = intern("pushr");
+  CONS_SYM = intern("cons");
+  READ_SYM = intern("read");
+  PRINT_SYM = intern("print");
 
+#ifndef BAREMETAL
+  /* the files named on the command line come before stdin, in order,
+     except that a batch job reads only its own */
+  if (job_path) open_source(job_path);
+  else for (ulong i = n_source_args; i-- > 0;) open_source(source_args[i]);
+  if (!n_source_args)
+#endif
   read_char();                  // clear the dummy peek char
 
 
@@ -1156,11 +3774,16 @@ int forsp_main() {
    * return_stack.cdr = new_cons(NIL_TAG,0);
    */
 
-  return_stack.car = NIL_TAG;
-  return_stack.cdr = 0;
+  FP = FRAME_BASE;
+  FST(FP) = NIL_TAG;
+  SND(FP) = 0;
 
   /* Begin! */
   while (1) {
+#ifndef BAREMETAL
+    /* a line is done and the next read waits on the user */
+    if (!source_top && next_char == '\n') flush_output();
+#endif
     {
       /* Returns list of reads guarenteed to empty read_stack. */
       cell cur;
@@ -1171,10 +3794,10 @@ int forsp_main() {
       } while (TAG_MASK(read_stack.car) != NIL_TAG);
       PUSH(NIL_TAG, 0);
       while (SP != stack_marker) {
-        ulong* tail = new_cons(*SP, *(SP+1));
+        ulong* tail = box(*SP, *(SP+1));
         *SP = CONS_TAG;
         *(SP+1) = tail;
-        tail = new_cons(*(SP+2), *(SP+3));
+        tail = box(*(SP+2), *(SP+3));
         *SP = (ulong)tail | CONS_TAG;
         *(SP+2) = *SP;
         *(SP+3) = *(SP+1);
@@ -1197,7 +3820,250 @@ int forsp_main() {
 }
 
 #ifndef BAREMETAL
+ulong parse_size(char* str) {
+  /* A size in bytes, optionally followed by k, m or g. */
+  char* end = str;
+  ulong size = 0;
+  while (*end >= '0' && *end <= '9') size = size*10 + (*end++ - '0');
+  switch (*end) {
+  case 'g': case 'G': size <<= 10;
+    /* fall through */
+  case 'm': case 'M': size <<= 10;
+    /* fall through */
+  case 'k': case 'K': size <<= 10; ++end;
+  }
+  if (*end || !size) {
+    print_err(str);
+    quit(": bad size!\n");
+  }
+  return size;
+}
+
+ulong parse_count(char* str) {
+  /* A plain positive number. */
+  char* end = str;
+  ulong n = 0;
+  while (*end >= '0' && *end <= '9') n = n*10 + (*end++ - '0');
+  if (*end || !n) {
+    print_err(str);
+    quit(": bad count!\n");
+  }
+  return n;
+}
+
+struct size_opt {char* flag; char* env; ulong* size;};
+struct size_opt size_opts[] = {
+  {"--heap=", "FPIR_HEAP", &HEAPSIZE},
+  {"--heap-max=", "FPIR_HEAP_MAX", &HEAPMAX},
+  {"--dict=", "FPIR_DICT", &DICTSIZE},
+  {"--stack=", "FPIR_STACK", &STACKSIZE},
+  {"--frames=", "FPIR_FRAMES", &FRAMESIZE},
+};
+#define N_SIZE_OPTS (sizeof(size_opts) / sizeof(struct size_opt))
+
+void configure(int argc, char** argv) {
+  /* Picks up settings from the environment, and then from the command
+     line, which wins. */
+  for (ulong i = 0; i < N_SIZE_OPTS; ++i) {
+    char* v = getenv(size_opts[i].env);
+    if (v) *size_opts[i].size = parse_size(v);
+  }
+  if (getenv("FPIR_STATS")) stats_at_exit = 1;
+  char* profile_path = getenv("FPIR_PROFILE");
+  char* gc_stress_mode = getenv("FPIR_GC_STRESS");
+  image_path = getenv("FPIR_IMAGE");
+  char* jobs = getenv("FPIR_JOBS");
+  char* gc_pause_us = getenv("FPIR_GC_PAUSE");
+  char* gc_mode = getenv("FPIR_GC");
+  for (int a = 1; a < argc; ++a) {
+    if (!strcmp(argv[a], "--stats")) {
+      stats_at_exit = 1;
+      continue;
+    }
+    if (!strncmp(argv[a], "--profile=", 10)) {
+      profile_path = argv[a] + 10;
+      continue;
+    }
+    if (!strncmp(argv[a], "--image=", 8)) {
+      image_path = argv[a] + 8;
+      continue;
+    }
+    if (!strncmp(argv[a], "--gc-stress=", 12)) {
+      gc_stress_mode = argv[a] + 12;
+      continue;
+    }
+    if (!strncmp(argv[a], "--gc=", 5)) {
+      gc_mode = argv[a] + 5;
+      continue;
+    }
+    if (!strncmp(argv[a], "--gc-pause=", 11)) {
+      gc_pause_us = argv[a] + 11;
+      continue;
+    }
+    if (!strncmp(argv[a], "--jobs=", 7)) {
+      jobs = argv[a] + 7;
+      continue;
+    }
+    if (strncmp(argv[a], "--", 2)) {
+      if (n_source_args == MAX_SOURCES) quit("Too many files!\n");
+      source_args[n_source_args++] = argv[a];
+      continue;
+    }
+    ulong i;
+    for (i = 0; i < N_SIZE_OPTS; ++i) {
+      ulong len = strlen(size_opts[i].flag);
+      if (!strncmp(argv[a], size_opts[i].flag, len)) {
+        *size_opts[i].size = parse_size(argv[a] + len);
+        break;
+      }
+    }
+    if (i == N_SIZE_OPTS) {
+      print_err(argv[a]);
+      quit(": unknown argument!\n");
+    }
+  }
+  if (HEAPMAX < HEAPSIZE) HEAPMAX = HEAPSIZE;
+  if (gc_pause_us) gc_pause_limit = 1000 * parse_count(gc_pause_us);
+  if (gc_mode) {
+    if (!strcmp(gc_mode, "compact")) gc_compact = 1;
+    else if (!strcmp(gc_mode, "copy")) gc_compact = 0;
+    else {
+      print_err(gc_mode);
+      quit(": unknown gc mode!\n");
+    }
+  }
+  /* the incremental cycles copy into tospace */
+  if (gc_compact && gc_pause_limit)
+    quit("--gc-pause doesn't go with --gc=compact!\n");
+  if (jobs) {
+    batch_jobs = parse_count(jobs);
+    /* the profiling timer is for the whole process */
+    if (profile_path) quit("--profile doesn't go with --jobs!\n");
+    if (!n_source_args) quit("--jobs needs files to run!\n");
+  }
+  if (profile_path) start_profile(profile_path);
+  if (gc_stress_mode) {
+    if (!strcmp(gc_stress_mode, "minor")) gc_stress = GC_STRESS_MINOR;
+    else if (!strcmp(gc_stress_mode, "full")) gc_stress = GC_STRESS_FULL;
+    else {
+      print_err(gc_stress_mode);
+      quit(": unknown gc stress mode!\n");
+    }
+  }
+}
+
+/* The batch runner. With --jobs=N, each file named on the command
+   line is a job of its own, run to the end by a fresh interpreter
+   (starting from the image, if there is one) on one of N threads. A
+   job's output is written all at once when it is done, so jobs never
+   interleave, but they finish in whatever order they finish. */
+#define JOB_STACK_SIZE 0x800000
+ulong batch_next = 0;
+char batch_failed = 0;
+
+SANITY(PER_INTERP char job_logname[32];)
+
+void reset_interp(void) {
+  /* Puts back the PER_INTERP variables that the job before could have
+     left changed and that forsp_main doesn't set itself, so that the
+     next job starts the way a new process would. A job that failed
+     may have stopped anywhere, in the middle of a collection even. */
+  depth = 0;
+  stats = (struct stats){0};
+  read_stack = (cell){NIL_TAG, 0};
+  outbuf_len = 0;
+  job_out = 0;
+  job_out_len = job_out_cap = 0;
+  gc_minor = gc_replica = gc_compacting = 0;
+  gc_phase = GC_IDLE;
+  fwd_clear = fwd_dirty = 0;
+  remset_top = 0;
+  remset_overflow = 0;
+  c_roots_top = 0;
+  mark_top = 0;
+  mark_overflow = 0;
+  next_char = ' ';
+  at_eof = 0;
+  source_top = 0;
+  symcount = 0;
+  print_depth = 0;
+  SANITY(read_depth = 0;)
+  from_image = 0;
+  /* the primitives are interned, and may collect, before these are set */
+  FP = root_env = 0;
+  M = 0;
+  nursery = fromspace = tospace = fwdtab = markbits = markoffs = 0;
+}
+
+void run_job(ulong i) {
+  jmp_buf exit_to;
+  reset_interp();
+  job_path = source_args[i];
+  /* and the graph dumps of each job go to a file of its own */
+  SANITY(snprintf(job_logname, sizeof(job_logname), "mdump.%llu.dot", i);
+         logfilename = job_logname;)
+  job_exit = &exit_to;
+  switch (setjmp(exit_to)) {
+  case 0:
+    forsp_main();
+    break;
+  case 2:
+    print_err(job_path);
+    print_err(": job failed!\n");
+    batch_failed = 1;
+  }
+  job_exit = 0;
+  flush_output();
+  fwrite(job_out, 1, job_out_len, stdout);
+  fflush(stdout);
+  free(job_out);
+  /* and give back what the interpreter had mapped */
+  while (source_top) {
+    struct source* s = &sources[--source_top];
+    munmap(s->base, s->end - s->base);
+  }
+  if (M) munmap(M, MEMSIZE);
+  if (nursery) munmap(nursery, NURSERYSIZE);
+  if (gc_compact) {
+    if (fromspace) munmap(fromspace, compact_semi(HEAPMAX));
+    if (markbits)
+      munmap(markbits, 2*sizeof(ulong)*mark_words(compact_semi(HEAPMAX)));
+  } else if (fromspace) {
+    munmap(fromspace, SEMIHEAPSIZE);
+    munmap(tospace, SEMIHEAPSIZE);
+  }
+  if (fwdtab) munmap(fwdtab, SEMIHEAPSIZE/2);
+}
+
+void* batch_worker(void* unused) {
+  ulong i;
+  while ((i = __atomic_fetch_add(&batch_next, 1, __ATOMIC_RELAXED)) < n_source_args)
+    run_job(i);
+  return 0;
+}
+
+int run_batch() {
+  pthread_t workers[MAX_SOURCES];
+  pthread_attr_t attr;
+  ulong image_len = 0;
+  ulong n = batch_jobs < n_source_args ? batch_jobs : n_source_args;
+  /* the sizes settle here, before any job lays out its memory */
+  batch_image = open_image(&image_len);
+  /* the jobs run on the workers, which need room for deep reads and
+     compiles */
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, JOB_STACK_SIZE);
+  for (ulong i = 0; i < n; ++i)
+    if (pthread_create(&workers[i], &attr, batch_worker, 0))
+      panic("Can't start a worker!\n");
+  for (ulong i = 0; i < n; ++i) pthread_join(workers[i], 0);
+  if (image_len) munmap(batch_image, image_len);
+  return batch_failed;
+}
+
 int main(int argc, char** argv) {
+  configure(argc, argv);
+  if (batch_jobs) return run_batch();
   return forsp_main();
 }
 #endif
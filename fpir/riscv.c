@@ -19,14 +19,8 @@ void putchar(char c) {
   rb_ptr = (rb_ptr + 1) % RINGBUFLEN;
 }
 
-void putstring(char* msg) {
-  while (*msg) {
-    putchar(*msg);
-    ++msg;
-  }
-}
-
 void print_err(char* msg) {
+  flush_output();
   while (*msg) {
     putchar(*msg);
     ++msg;
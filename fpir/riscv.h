@@ -1,5 +1,6 @@
 char getchar(void);
 void putchar(char);
+void flush_output(void);
 /* M is set by linker */
 void print_err(char*);
-void panic(char*);
+void panic(char*) __attribute__((noreturn));